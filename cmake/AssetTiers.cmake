@@ -0,0 +1,35 @@
+# Resamples the bitmaps listed in data/tiers.ini into a directory per
+# resolution tier, see src/tiers.c. Run through the asset-tiers target.
+# The results are committed, so this is only needed after changing the art.
+
+find_program(MAGICK NAMES magick convert)
+if(NOT MAGICK)
+	message(FATAL_ERROR "ImageMagick is needed to generate asset tiers")
+endif(NOT MAGICK)
+
+# name:numerator:denominator of the scale relative to 1080p
+set(TIERS "720p:2:3" "1080p:1:1" "2160p:2:1")
+
+file(STRINGS "${DATA_DIR}/tiers.ini" ENTRIES REGEX "^[^#].*=[0-9]+x[0-9]+$")
+foreach(ENTRY ${ENTRIES})
+	string(REGEX MATCH "^(.*)=([0-9]+)x([0-9]+)$" MATCHED "${ENTRY}")
+	set(NAME "${CMAKE_MATCH_1}")
+	set(WIDTH "${CMAKE_MATCH_2}")
+	set(HEIGHT "${CMAKE_MATCH_3}")
+	foreach(TIER ${TIERS})
+		string(REPLACE ":" ";" TIER "${TIER}")
+		list(GET TIER 0 TIER_NAME)
+		list(GET TIER 1 NUM)
+		list(GET TIER 2 DEN)
+		math(EXPR TIER_WIDTH "(${WIDTH} * ${NUM} * 2 + ${DEN}) / (${DEN} * 2)")
+		math(EXPR TIER_HEIGHT "(${HEIGHT} * ${NUM} * 2 + ${DEN}) / (${DEN} * 2)")
+		get_filename_component(TIER_DIR "${DATA_DIR}/${TIER_NAME}/${NAME}" PATH)
+		file(MAKE_DIRECTORY "${TIER_DIR}")
+		message(STATUS "${TIER_NAME}/${NAME}: ${TIER_WIDTH}x${TIER_HEIGHT}")
+		execute_process(COMMAND "${MAGICK}" "${DATA_DIR}/${NAME}" -filter Box -resize "${TIER_WIDTH}x${TIER_HEIGHT}!" -strip "${DATA_DIR}/${TIER_NAME}/${NAME}"
+			RESULT_VARIABLE RESULT)
+		if(RESULT)
+			message(FATAL_ERROR "Could not resample ${NAME}")
+		endif(RESULT)
+	endforeach(TIER)
+endforeach(ENTRY)
@@ -0,0 +1,122 @@
+/*! \file arena.c
+ *  \brief Per-gamestate arena allocator.
+ */
+/*
+ * Copyright (c) Sebastian Krzyszkowiak <dos@dosowisko.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "common.h"
+#include <libsuperderpy.h>
+#include <stddef.h>
+
+// Gamestates allocate everything that lives until Gamestate_Unload from their arena,
+// GamestateResources included, and release it all at once with DestroyArena.
+// Resources that need their own destructor can be handed over with ArenaDefer.
+
+struct ArenaBlock {
+	struct ArenaBlock* next;
+	size_t size, used;
+	max_align_t data[];
+};
+
+struct ArenaCleanup {
+	void (*destroy)(void*);
+	void* ptr;
+	struct ArenaCleanup* next;
+};
+
+struct Arena* CreateArena(struct Game* game, const char* name) {
+	struct Arena* arena = calloc(1, sizeof(struct Arena));
+	arena->game = game;
+	arena->name = name;
+	return arena;
+}
+
+void* ArenaAlloc(struct Arena* arena, size_t size) {
+	size = (size + sizeof(max_align_t) - 1) / sizeof(max_align_t) * sizeof(max_align_t);
+
+	struct ArenaBlock* block = arena->blocks;
+	if (!block || (block->used + size > block->size)) {
+		size_t capacity = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+		block = calloc(1, sizeof(struct ArenaBlock) + capacity);
+		block->size = capacity;
+		block->next = arena->blocks;
+		arena->blocks = block;
+		arena->reserved += capacity;
+	}
+
+	void* ptr = (char*)block->data + block->used;
+	block->used += size;
+	arena->used += size;
+
+	struct CommonResources* data = arena->game->data;
+	if (data) {
+		al_lock_mutex(data->arenas.mutex);
+		data->arenas.bytes += size;
+		if (data->arenas.bytes > data->arenas.peak) {
+			data->arenas.peak = data->arenas.bytes;
+		}
+		al_unlock_mutex(data->arenas.mutex);
+	}
+	return ptr;
+}
+
+void ArenaDefer(struct Arena* arena, void (*destroy)(void*), void* ptr) {
+	// Cleanups run in reverse order of registration.
+	if (!ptr) {
+		return;
+	}
+	struct ArenaCleanup* cleanup = ArenaAlloc(arena, sizeof(struct ArenaCleanup));
+	cleanup->destroy = destroy;
+	cleanup->ptr = ptr;
+	cleanup->next = arena->cleanups;
+	arena->cleanups = cleanup;
+}
+
+static void DestroyBitmap(void* bitmap) {
+	al_destroy_bitmap(bitmap);
+}
+
+ALLEGRO_BITMAP* ArenaBitmap(struct Arena* arena, ALLEGRO_BITMAP* bitmap) {
+	ArenaDefer(arena, DestroyBitmap, bitmap);
+	return bitmap;
+}
+
+void DestroyArena(struct Arena* arena) {
+	for (struct ArenaCleanup* cleanup = arena->cleanups; cleanup; cleanup = cleanup->next) {
+		cleanup->destroy(cleanup->ptr);
+	}
+
+	struct CommonResources* data = arena->game->data;
+	int blocks = 0;
+	while (arena->blocks) {
+		struct ArenaBlock* next = arena->blocks->next;
+		free(arena->blocks);
+		arena->blocks = next;
+		blocks++;
+	}
+	if (data) {
+		al_lock_mutex(data->arenas.mutex);
+		data->arenas.bytes -= arena->used;
+		size_t peak = data->arenas.peak;
+		al_unlock_mutex(data->arenas.mutex);
+		PrintConsole(arena->game, "arena %s: %zu bytes used in %d blocks (%zu reserved), peak of all arenas %zu bytes",
+			arena->name, arena->used, blocks, arena->reserved, peak);
+	}
+	ReportResources(arena->game, arena->name);
+	free(arena);
+}
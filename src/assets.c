@@ -0,0 +1,251 @@
+/*! \file assets.c
+ *  \brief Asset memory and load cost report.
+ */
+/*
+ * Copyright (c) Sebastian Krzyszkowiak <dos@dosowisko.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "common.h"
+#include <libsuperderpy.h>
+#include <string.h>
+
+#undef GetDataFilePath // this is where the real one gets called
+
+// With --asset-report, every data file requested by the gamestates is recorded
+// along with the gamestate that asked for it. Once everything is loaded, each file
+// gets loaded once more on its own to measure it and the table is written out.
+
+char* TrackDataFilePath(struct Game* game, const char* filename) {
+	TraceDataFile(game, filename);
+	CountLoadedAssets(game, filename);
+
+	struct AssetReport* report = game->data ? &game->data->assets : NULL;
+	if (!report || !report->enabled) {
+		return GetDataFilePath(game, TieredAssetName(game, filename));
+	}
+
+	al_lock_mutex(report->mutex);
+	if (report->written) {
+		al_unlock_mutex(report->mutex);
+		return GetDataFilePath(game, TieredAssetName(game, filename));
+	}
+
+	struct AssetRecord* record = NULL;
+	for (int i = 0; i < report->count; i++) {
+		if (!strcmp(report->records[i].name, filename)) {
+			record = &report->records[i];
+			break;
+		}
+	}
+	if (!record) {
+		report->records = realloc(report->records, sizeof(struct AssetRecord) * (report->count + 1));
+		record = &report->records[report->count++];
+		*record = (struct AssetRecord){0};
+		record->name = strdup(filename);
+	}
+
+	const char* scope = report->scope ? report->scope : "main";
+	if (!strstr(record->gamestates, scope) && (strlen(record->gamestates) + strlen(scope) + 2 < sizeof(record->gamestates))) {
+		if (record->gamestates[0]) {
+			strcat(record->gamestates, " ");
+		}
+		strcat(record->gamestates, scope);
+	}
+	al_unlock_mutex(report->mutex);
+
+	return GetDataFilePath(game, TieredAssetName(game, filename));
+}
+
+void StartAssetReport(struct Game* game, const char* filename) {
+	struct AssetReport* report = &game->data->assets;
+	report->output = filename;
+	report->mutex = al_create_mutex();
+	report->enabled = true;
+}
+
+void SetAssetScope(struct Game* game, const char* gamestate) {
+	if (game->data) {
+		game->data->assets.scope = gamestate;
+	}
+	SetResourceScope(gamestate);
+	NameTraceThread(game, "loader");
+}
+
+static bool HasExtension(const char* name, const char* extensions) {
+	const char* ext = strrchr(name, '.');
+	return ext && strstr(extensions, ext);
+}
+
+#define PIXEL_FORMAT(name) {ALLEGRO_PIXEL_FORMAT_##name, #name}
+
+static const struct {
+	int format;
+	const char* name;
+} PIXEL_FORMATS[] = {
+	PIXEL_FORMAT(ARGB_8888),
+	PIXEL_FORMAT(RGBA_8888),
+	PIXEL_FORMAT(ARGB_4444),
+	PIXEL_FORMAT(RGB_888),
+	PIXEL_FORMAT(RGB_565),
+	PIXEL_FORMAT(RGB_555),
+	PIXEL_FORMAT(RGBA_5551),
+	PIXEL_FORMAT(ARGB_1555),
+	PIXEL_FORMAT(ABGR_8888),
+	PIXEL_FORMAT(XBGR_8888),
+	PIXEL_FORMAT(BGR_888),
+	PIXEL_FORMAT(BGR_565),
+	PIXEL_FORMAT(BGR_555),
+	PIXEL_FORMAT(RGBX_8888),
+	PIXEL_FORMAT(XRGB_8888),
+	PIXEL_FORMAT(ABGR_F32),
+	PIXEL_FORMAT(ABGR_8888_LE),
+	PIXEL_FORMAT(RGBA_4444),
+	PIXEL_FORMAT(SINGLE_CHANNEL_8),
+	PIXEL_FORMAT(COMPRESSED_RGBA_DXT1),
+	PIXEL_FORMAT(COMPRESSED_RGBA_DXT3),
+	PIXEL_FORMAT(COMPRESSED_RGBA_DXT5),
+};
+
+static const char* GetPixelFormatName(int format) {
+	for (size_t i = 0; i < sizeof(PIXEL_FORMATS) / sizeof(PIXEL_FORMATS[0]); i++) {
+		if (PIXEL_FORMATS[i].format == format) {
+			return PIXEL_FORMATS[i].name;
+		}
+	}
+	return "";
+}
+
+void MarkMaskAsset(struct Game* game, const char* filename) {
+	// Masks end up in single channel textures, so they have to be measured as such.
+	struct AssetReport* report = game->data ? &game->data->assets : NULL;
+	if (!report || !report->enabled) {
+		return;
+	}
+	al_lock_mutex(report->mutex);
+	for (int i = 0; i < report->count; i++) {
+		if (!strcmp(report->records[i].name, filename)) {
+			report->records[i].mask = true;
+			break;
+		}
+	}
+	al_unlock_mutex(report->mutex);
+}
+
+static long long MeasureAsset(struct Game* game, struct AssetRecord* record, FILE* out) {
+	const char* path = GetDataFilePath(game, TieredAssetName(game, record->name));
+	ALLEGRO_FS_ENTRY* entry = al_create_fs_entry(path);
+	long long disk = al_fs_entry_exists(entry) ? (long long)al_get_fs_entry_size(entry) : -1;
+	al_destroy_fs_entry(entry);
+
+	const char* ext = strrchr(record->name, '.');
+	int width = 0, height = 0, format = 0;
+	long long bytes = 0;
+	double decode = 0, upload = 0;
+
+	double start = al_get_time();
+	if (record->mask) {
+		// Converted to a single channel on the way, so decoding covers the upload as well.
+		ALLEGRO_BITMAP* bitmap = LoadMaskBitmap(game, record->name);
+		decode = al_get_time() - start;
+		if (bitmap) {
+			width = al_get_bitmap_width(bitmap);
+			height = al_get_bitmap_height(bitmap);
+			format = al_get_bitmap_format(bitmap);
+			bytes = (long long)width * height * al_get_pixel_size(format);
+			al_destroy_bitmap(bitmap);
+		}
+	} else if (HasExtension(record->name, ".png.webp.jpg")) {
+		int flags = al_get_new_bitmap_flags();
+		al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+		ALLEGRO_BITMAP* bitmap = al_load_bitmap(path);
+		al_set_new_bitmap_flags(flags);
+		decode = al_get_time() - start;
+		if (bitmap) {
+			start = al_get_time();
+			ALLEGRO_BITMAP* video = al_clone_bitmap(bitmap);
+			upload = al_get_time() - start;
+			width = al_get_bitmap_width(video);
+			height = al_get_bitmap_height(video);
+			format = al_get_bitmap_format(video);
+			bytes = (long long)width * height * al_get_pixel_size(format);
+			al_destroy_bitmap(video);
+			al_destroy_bitmap(bitmap);
+		}
+	} else if (HasExtension(record->name, ".flac.ogg.wav.opus")) {
+		// Streams only keep a few fragments around, but this is what decoding all of it costs.
+		ALLEGRO_SAMPLE* sample = al_load_sample(path);
+		decode = al_get_time() - start;
+		if (sample) {
+			bytes = (long long)al_get_sample_length(sample) * al_get_channel_count(al_get_sample_channels(sample)) *
+				al_get_audio_depth_size(al_get_sample_depth(sample));
+			al_destroy_sample(sample);
+		}
+	} else if (HasExtension(record->name, ".ttf.otf")) {
+		ALLEGRO_FONT* font = al_load_ttf_font(path, 48, 0);
+		decode = al_get_time() - start;
+		if (font) {
+			al_destroy_font(font);
+		}
+	} else if (HasExtension(record->name, ".ini")) {
+		ALLEGRO_CONFIG* config = al_load_config_file(path);
+		decode = al_get_time() - start;
+		if (config) {
+			al_destroy_config(config);
+		}
+	}
+
+	fprintf(out, "%s,%s,%lld,%d,%d,%s,%lld,%.3f,%.3f,%s\n", record->name, ext ? ext + 1 : "", disk, width, height, GetPixelFormatName(format),
+		bytes, decode * 1000.0, upload * 1000.0, record->gamestates);
+	return disk;
+}
+
+void WriteAssetReport(struct Game* game) {
+	struct AssetReport* report = &game->data->assets;
+	al_lock_mutex(report->mutex);
+	report->written = true;
+	al_unlock_mutex(report->mutex);
+
+	FILE* out = fopen(report->output, "w");
+	if (!out) {
+		PrintConsole(game, "Could not write the asset report to %s", report->output);
+		return;
+	}
+	fprintf(out, "file,format,disk_bytes,width,height,pixel_format,memory_bytes,decode_ms,upload_ms,gamestates\n");
+	long long total = 0;
+	for (int i = 0; i < report->count; i++) {
+		long long disk = MeasureAsset(game, &report->records[i], out);
+		if (disk > 0) {
+			total += disk;
+		}
+	}
+	fclose(out);
+	PrintConsole(game, "Asset report: %d files, %lld bytes on disk, written to %s", report->count, total, report->output);
+}
+
+void DestroyAssetReport(struct Game* game) {
+	struct AssetReport* report = &game->data->assets;
+	for (int i = 0; i < report->count; i++) {
+		free(report->records[i].name);
+	}
+	free(report->records);
+	report->records = NULL;
+	report->count = 0;
+	if (report->mutex) {
+		al_destroy_mutex(report->mutex);
+		report->mutex = NULL;
+	}
+}
@@ -0,0 +1,97 @@
+/*! \file canvas.c
+ *  \brief Reduced resolution canvas standing in for the framebuffer.
+ */
+/*
+ * Copyright (c) Sebastian Krzyszkowiak <dos@dosowisko.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "common.h"
+#include <libsuperderpy.h>
+
+#undef SetFramebufferAsTarget // this is where the real one gets called
+
+// Gamestates draw in viewport coordinates into whatever SetFramebufferAsTarget
+// gives them. With render_scale below 100% that's the canvas: a bitmap of the
+// reduced size, with a transform scaling everything drawn into it down. It gets
+// upscaled into the real framebuffer once per frame in PostDrawHandler, so every
+// gamestate fills fewer pixels and the only full resolution pass left is the one
+// presenting the frame. Headless runs always draw into the canvas and never
+// present it.
+//
+// The loading screen is drawn by the engine outside of PreDrawHandler and
+// PostDrawHandler, so it keeps going straight to the framebuffer.
+//
+// Between BeginCachedFrame and FinishCachedFrame the frame cache being drawn
+// takes the place of both.
+
+void CreateCanvas(struct Game* game) {
+	struct CommonResources* data = game->data;
+	DestroyCanvas(game);
+	if (!data->headless.enabled && data->render_scale >= 1.0) {
+		return;
+	}
+	data->canvas = CreateRenderTarget(game, game->viewport.width, game->viewport.height, 1.0);
+}
+
+static bool UsingCanvas(struct Game* game) {
+	struct CommonResources* data = game->data;
+	return data && data->canvas && (data->headless.enabled || !game->loading.shown);
+}
+
+static void SetScaledTarget(struct Game* game, ALLEGRO_BITMAP* bitmap) {
+	ALLEGRO_TRANSFORM transform;
+	al_set_target_bitmap(bitmap);
+	al_identity_transform(&transform);
+	al_scale_transform(&transform, game->data->render_scale, game->data->render_scale);
+	al_use_transform(&transform);
+}
+
+void SetCanvasAsTarget(struct Game* game) {
+	if (game->data && game->data->cache) {
+		SetScaledTarget(game, game->data->cache->bitmap);
+	} else if (UsingCanvas(game)) {
+		SetScaledTarget(game, game->data->canvas);
+	} else {
+		SetFramebufferAsTarget(game);
+	}
+	if (game->data) {
+		game->data->overdraw.target = al_get_target_bitmap();
+	}
+}
+
+void BeginCanvasFrame(struct Game* game) {
+	if (!UsingCanvas(game)) {
+		return;
+	}
+	SetCanvasAsTarget(game);
+	al_clear_to_color(al_map_rgb(0, 0, 0));
+}
+
+void PresentCanvas(struct Game* game) {
+	if (!UsingCanvas(game) || game->data->headless.enabled) {
+		return;
+	}
+	SetFramebufferAsTarget(game);
+	DrawRenderTarget(game->data->canvas, 0, 0, game->viewport.width, game->viewport.height);
+}
+
+void DestroyCanvas(struct Game* game) {
+	if (game->data->canvas) {
+		al_destroy_bitmap(game->data->canvas);
+		game->data->canvas = NULL;
+	}
+}
@@ -21,6 +21,8 @@
 
 #include "common.h"
 #include <libsuperderpy.h>
+#include <math.h>
+#include <string.h>
 
 bool GlobalEventHandler(struct Game* game, ALLEGRO_EVENT* ev) {
 	if ((ev->type == ALLEGRO_EVENT_KEY_DOWN) && (ev->keyboard.keycode == ALLEGRO_KEY_M)) {
@@ -31,6 +33,18 @@ bool GlobalEventHandler(struct Game* game, ALLEGRO_EVENT* ev) {
 		ToggleFullscreen(game);
 	}
 
+	if ((ev->type == ALLEGRO_EVENT_KEY_DOWN) && (ev->keyboard.keycode == ALLEGRO_KEY_F9) && game->data->overdraw.enabled) {
+		game->data->overdraw.dump = true;
+		return true;
+	}
+
+	if (ev->type == ALLEGRO_EVENT_DISPLAY_SWITCH_OUT) {
+		game->data->focused = false;
+	}
+	if (ev->type == ALLEGRO_EVENT_DISPLAY_SWITCH_IN) {
+		game->data->focused = true;
+	}
+
 #ifdef ALLEGRO_ANDROID
 	if ((ev->type == ALLEGRO_EVENT_KEY_DOWN) && (ev->keyboard.keycode == ALLEGRO_KEY_BACK)) {
 		QuitGame(game, true);
@@ -40,14 +54,362 @@ bool GlobalEventHandler(struct Game* game, ALLEGRO_EVENT* ev) {
 	return false;
 }
 
+void PreDrawHandler(struct Game* game) {
+	StepExport(game);
+	BeginCanvasFrame(game);
+	BeginHeadlessFrame(game);
+}
+
+void PostDrawHandler(struct Game* game) {
+	struct CommonResources* data = game->data;
+	PresentCanvas(game);
+	FinishHeadlessFrame(game);
+	ExportFrame(game);
+	if (data->assets.enabled && !data->assets.written && !game->loading.shown) {
+		// everything requested on startup has been loaded by now
+		WriteAssetReport(game);
+		QuitGame(game, false);
+	}
+
+	double now = al_get_time();
+	if (data->static_frame) {
+		if (!data->static_since) {
+			data->static_since = now;
+		}
+	} else {
+		data->static_since = 0;
+	}
+	data->static_frame = false;
+}
+
+static double GetThrottledFPS(struct Game* game) {
+	// Frame rate to draw at when nobody is looking or nothing is moving, 0 for no limit.
+	struct CommonResources* data = game->data;
+	if (!data->focused || data->paused) {
+		return data->idle_fps;
+	}
+	if (data->static_since && al_get_time() - data->static_since > STATIC_THROTTLE_DELAY) {
+		return data->static_fps;
+	}
+	return 0;
+}
+
+static void MixerPostprocess(void* buffer, unsigned int samples, void* userdata) {
+	// Runs on the audio thread after every buffer mixed by the master mixer.
+	struct Game* game = userdata;
+	if (!game->data) {
+		return;
+	}
+	NameTraceThread(game, "audio");
+	TraceInstant(game, "mix");
+	CaptureAudio(game, buffer, samples);
+}
+
 struct CommonResources* CreateGameData(struct Game* game) {
 	struct CommonResources* data = calloc(1, sizeof(struct CommonResources));
 	data->score = 0;
 	data->darkloading = false;
 	data->skiptoend = false;
+
+	// render_size (like 1280x720) takes precedence over render_scale (in percent)
+	int width, height;
+	const char* size = GetConfigOptionDefault(game, "SpiderDisco", "render_size", "");
+	if (sscanf(size, "%dx%d", &width, &height) == 2) {
+		data->render_scale = fmin(width / 1920.0, height / 1080.0);
+	} else {
+		data->render_scale = atof(GetConfigOptionDefault(game, "SpiderDisco", "render_scale", "100")) / 100.0;
+	}
+	data->render_scale = fmax(0.25, fmin(data->render_scale, 1.0));
+
+	data->overdraw.enabled = strtol(GetConfigOptionDefault(game, "SpiderDisco", "overdraw", "0"), NULL, 10);
+
+	// 0 disables throttling
+	data->focused = true;
+	data->idle_fps = atof(GetConfigOptionDefault(game, "SpiderDisco", "idle_fps", "10"));
+	data->static_fps = atof(GetConfigOptionDefault(game, "SpiderDisco", "static_fps", "20"));
+
+	// memory cap for assets decoded ahead of time, in MB; 0 disables prewarming
+	data->prewarm.limit = strtol(GetConfigOptionDefault(game, "SpiderDisco", "prewarm_limit", "128"), NULL, 10) * 1024 * 1024;
+
+	data->loading.mutex = al_create_mutex(); // see progress.c
+	data->arenas.mutex = al_create_mutex();
+
+	al_set_mixer_postprocess_callback(game->audio.mixer, MixerPostprocess, game);
 	return data;
 }
 
 void DestroyGameData(struct Game* game) {
+	al_set_mixer_postprocess_callback(game->audio.mixer, NULL, NULL);
+	FinishSpectrum(game);
+	FinishTrace(game);
+	FinishReplay(game);
+	FinishExport(game);
+	FinishHeadless(game);
+	DestroyCanvas(game);
+	DestroyPrewarm(game);
+	DestroyOverdraw(game);
+	DestroyAssetReport(game);
+	DestroyLoadingProgress(game);
+	DestroyAssetTiers(game);
+	DestroyMaskShader(game);
+	ReportResources(game, NULL);
+	al_destroy_mutex(game->data->arenas.mutex);
 	free(game->data);
 }
+
+void ResetHistogram(struct Histogram* histogram) {
+	memset(histogram, 0, sizeof(struct Histogram));
+}
+
+void AddToHistogram(struct Histogram* histogram, double ms) {
+	int bucket = ms;
+	if (bucket < 0) {
+		bucket = 0;
+	}
+	if (bucket >= HISTOGRAM_BUCKETS) {
+		bucket = HISTOGRAM_BUCKETS - 1;
+	}
+	histogram->buckets[bucket]++;
+	histogram->count++;
+	histogram->sum += ms;
+	if (ms > histogram->max) {
+		histogram->max = ms;
+	}
+}
+
+double GetHistogramPercentile(struct Histogram* histogram, double percentile) {
+	int target = histogram->count * percentile;
+	int sum = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		sum += histogram->buckets[i];
+		if (sum > target) {
+			return i + 1;
+		}
+	}
+	return HISTOGRAM_BUCKETS;
+}
+
+void PrintHistogram(struct Game* game, struct Histogram* histogram, char* name) {
+	if (!histogram->count) {
+		PrintConsole(game, "%s: no samples", name);
+		return;
+	}
+	PrintConsole(game, "%s: n=%d avg=%.2fms p50<%.0fms p95<%.0fms max=%.2fms", name, histogram->count,
+		histogram->sum / histogram->count, GetHistogramPercentile(histogram, 0.5),
+		GetHistogramPercentile(histogram, 0.95), histogram->max);
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		if (!histogram->buckets[i]) {
+			continue;
+		}
+		char bar[51] = "";
+		int len = histogram->buckets[i] * 50 / histogram->count;
+		memset(bar, '#', len);
+		bar[len] = 0;
+		PrintConsole(game, "  %3d%s ms: %5d %s", i, (i == HISTOGRAM_BUCKETS - 1) ? "+" : " ", histogram->buckets[i], bar);
+	}
+}
+
+ALLEGRO_BITMAP* CreateRenderTarget(struct Game* game, int width, int height, float scale) {
+	// Creates an offscreen bitmap to be drawn on using width x height coordinates,
+	// but backed by a texture reduced by scale and the configured render scale.
+	scale *= game->data->render_scale;
+	ALLEGRO_BITMAP* target = al_get_target_bitmap();
+	int flags = al_get_new_bitmap_flags();
+	if (scale < 1.0) {
+		al_add_new_bitmap_flag(ALLEGRO_MIN_LINEAR | ALLEGRO_MAG_LINEAR);
+	}
+	ALLEGRO_BITMAP* bitmap = CreateNotPreservedBitmap(ceil(width * scale), ceil(height * scale));
+	al_set_new_bitmap_flags(flags);
+
+	ALLEGRO_TRANSFORM transform;
+	al_set_target_bitmap(bitmap);
+	al_identity_transform(&transform);
+	al_scale_transform(&transform, scale, scale);
+	al_use_transform(&transform);
+	if (target) {
+		al_set_target_bitmap(target);
+	}
+	return bitmap;
+}
+
+void DrawRenderTarget(ALLEGRO_BITMAP* bitmap, float x, float y, float width, float height) {
+	al_draw_scaled_bitmap(bitmap, 0, 0, al_get_bitmap_width(bitmap), al_get_bitmap_height(bitmap), x, y, width, height, 0);
+}
+
+void DrawTintedLayer(struct Game* game, const char* name, ALLEGRO_BITMAP* bitmap, ALLEGRO_COLOR tint, float x, float y) {
+	// Draws only the part of the bitmap that ends up inside the viewport.
+	int sx = fmax(0, floor(-x));
+	int sy = fmax(0, floor(-y));
+	int ex = fmin(al_get_bitmap_width(bitmap), ceil(game->viewport.width - x));
+	int ey = fmin(al_get_bitmap_height(bitmap), ceil(game->viewport.height - y));
+	if ((sx >= ex) || (sy >= ey)) {
+		return;
+	}
+	al_draw_tinted_bitmap_region(bitmap, tint, sx, sy, ex - sx, ey - sy, x + sx, y + sy, 0);
+	RecordOverdraw(game, name, x + sx, y + sy, ex - sx, ey - sy);
+}
+
+void DrawLayer(struct Game* game, const char* name, ALLEGRO_BITMAP* bitmap, float x, float y) {
+	DrawTintedLayer(game, name, bitmap, al_map_rgb(255, 255, 255), x, y);
+}
+
+void DrawRotatedLayer(struct Game* game, const char* name, ALLEGRO_BITMAP* bitmap, float cx, float cy, float dx, float dy, float angle) {
+	// Same as al_draw_rotated_bitmap, but skips texels that fall outside of the viewport.
+	// Viewport corners are mapped back into bitmap space and their bounding box
+	// is what gets drawn.
+	float c = cos(angle), s = sin(angle);
+	float minx = INFINITY, miny = INFINITY, maxx = -INFINITY, maxy = -INFINITY;
+	for (int i = 0; i < 4; i++) {
+		float px = (i % 2) ? game->viewport.width : 0;
+		float py = (i / 2) ? game->viewport.height : 0;
+		float lx = (px - dx) * c + (py - dy) * s + cx;
+		float ly = -(px - dx) * s + (py - dy) * c + cy;
+		minx = fmin(minx, lx);
+		miny = fmin(miny, ly);
+		maxx = fmax(maxx, lx);
+		maxy = fmax(maxy, ly);
+	}
+	// one pixel of margin for filtering
+	int sx = fmax(0, floor(minx) - 1);
+	int sy = fmax(0, floor(miny) - 1);
+	int ex = fmin(al_get_bitmap_width(bitmap), ceil(maxx) + 1);
+	int ey = fmin(al_get_bitmap_height(bitmap), ceil(maxy) + 1);
+	if ((sx >= ex) || (sy >= ey)) {
+		return;
+	}
+	al_draw_tinted_scaled_rotated_bitmap_region(bitmap, sx, sy, ex - sx, ey - sy, al_map_rgb(255, 255, 255),
+		cx - sx, cy - sy, dx, dy, 1, 1, angle, 0);
+
+	float points[8];
+	for (int i = 0; i < 4; i++) {
+		float lx = ((i == 1) || (i == 2)) ? ex : sx;
+		float ly = (i >= 2) ? ey : sy;
+		points[i * 2] = (lx - cx) * c - (ly - cy) * s + dx;
+		points[i * 2 + 1] = (lx - cx) * s + (ly - cy) * c + dy;
+	}
+	RecordOverdrawQuad(game, name, points);
+}
+
+bool BeginCachedFrame(struct Game* game, struct FrameCache* cache, unsigned long long signature) {
+	// Returns true when the frame has to be drawn, with SetFramebufferAsTarget pointing
+	// at wherever it should go until FinishCachedFrame. Otherwise FinishCachedFrame just
+	// puts the previous frame back on screen. That happens when signature (anything
+	// identifying what's visible) hasn't changed, and while the frame rate is throttled,
+	// which skips drawing instead of stalling the main loop.
+	// Frames that differ from the last one go straight into the framebuffer, so a moving
+	// screen costs nothing extra. The cache only gets drawn into once a frame repeats or
+	// frames are about to be skipped.
+	double now = al_get_time();
+	double fps = GetThrottledFPS(game);
+	bool due = !fps || (now - cache->drawn >= 1.0 / fps);
+	bool repeated = (signature == cache->signature);
+	cache->signature = signature;
+	if (repeated) {
+		game->data->static_frame = true;
+	}
+	cache->direct = false;
+	if (cache->valid && (repeated || !due)) {
+		return false;
+	}
+
+	cache->drawn = now;
+	if (!repeated && !fps) {
+		cache->valid = false;
+		cache->direct = true;
+		SetFramebufferAsTarget(game);
+		return true;
+	}
+	if (!cache->bitmap) {
+		cache->bitmap = CreateRenderTarget(game, game->viewport.width, game->viewport.height, 1.0);
+	}
+	cache->valid = true;
+	game->data->cache = cache;
+	SetFramebufferAsTarget(game);
+	return true;
+}
+
+void FinishCachedFrame(struct Game* game, struct FrameCache* cache) {
+	game->data->cache = NULL;
+	SetFramebufferAsTarget(game);
+	if (cache->direct) {
+		return;
+	}
+	DrawRenderTarget(cache->bitmap, 0, 0, game->viewport.width, game->viewport.height);
+	RecordOverdraw(game, "cache", 0, 0, game->viewport.width, game->viewport.height);
+}
+
+void InvalidateFrameCache(struct FrameCache* cache) {
+	cache->valid = false;
+}
+
+void DestroyFrameCache(struct FrameCache* cache) {
+	if (cache->bitmap) {
+		al_destroy_bitmap(cache->bitmap);
+	}
+	cache->bitmap = NULL;
+	cache->valid = false;
+}
+
+void InitGovernor(struct Game* game, struct Governor* governor, int levels, const char* setting) {
+	memset(governor, 0, sizeof(struct Governor));
+	governor->levels = levels;
+	governor->automatic = (strcmp(setting, "auto") == 0);
+	if (!governor->automatic) {
+		governor->level = atoi(setting);
+		if (governor->level < 0) {
+			governor->level = 0;
+		}
+		if (governor->level >= levels) {
+			governor->level = levels - 1;
+		}
+	}
+	int refresh = al_get_display_refresh_rate(game->display);
+	governor->budget = 1.0 / (refresh > 0 ? refresh : 60);
+	governor->step_up_delay = GOVERNOR_STEP_UP_DELAY;
+}
+
+bool UpdateGovernor(struct Governor* governor) {
+	// Call once per frame. Returns true when the quality level has changed.
+	double now = al_get_time();
+	double frame = now - governor->last;
+	governor->last = now;
+	if (!governor->automatic || frame > 0.25) {
+		// first frame or we've been stalled by something else, like loading
+		governor->sum = 0;
+		governor->frames = 0;
+		return false;
+	}
+
+	governor->sum += frame;
+	governor->frames++;
+	if (governor->frames < GOVERNOR_WINDOW) {
+		return false;
+	}
+
+	double window = governor->sum;
+	double average = window / governor->frames;
+	governor->sum = 0;
+	governor->frames = 0;
+
+	if (average > governor->budget * 1.2) {
+		governor->headroom = 0;
+		if (now - governor->last_step_up < GOVERNOR_STEP_UP_DELAY) {
+			// raising quality didn't work out, so wait longer before trying again
+			governor->step_up_delay = fmin(governor->step_up_delay * 2, 120);
+		}
+		if (governor->level < governor->levels - 1) {
+			governor->level++;
+			return true;
+		}
+	} else if (average < governor->budget * 1.05) {
+		governor->headroom += window;
+		if ((governor->headroom >= governor->step_up_delay) && (governor->level > 0)) {
+			governor->level--;
+			governor->headroom = 0;
+			governor->last_step_up = now;
+			return true;
+		}
+	}
+	return false;
+}
@@ -1,13 +1,469 @@
 #define LIBSUPERDERPY_DATA_TYPE struct CommonResources
 #include <libsuperderpy.h>
 
+// Every data file request goes through the asset report (see assets.c)
+// and the selected resolution tier (see tiers.c).
+#define GetDataFilePath(game, filename) TrackDataFilePath(game, filename)
+
+// Reduced render resolutions and headless runs draw into a canvas instead, see canvas.c.
+#define SetFramebufferAsTarget(game) SetCanvasAsTarget(game)
+
+// With STATIC_GAMESTATES every gamestate is compiled into the executable with
+// GAMESTATE_NAME set to its name, so their entry points need unique names.
+// See static.c for where they get registered.
+#ifdef GAMESTATE_NAME
+#define GAMESTATE_SYMBOL_(name, symbol) name##_##symbol
+#define GAMESTATE_SYMBOL(name, symbol) GAMESTATE_SYMBOL_(name, symbol)
+#define Gamestate_Draw GAMESTATE_SYMBOL(GAMESTATE_NAME, Gamestate_Draw)
+#define Gamestate_Logic GAMESTATE_SYMBOL(GAMESTATE_NAME, Gamestate_Logic)
+#define Gamestate_Tick GAMESTATE_SYMBOL(GAMESTATE_NAME, Gamestate_Tick)
+#define Gamestate_Load GAMESTATE_SYMBOL(GAMESTATE_NAME, Gamestate_Load)
+#define Gamestate_PostLoad GAMESTATE_SYMBOL(GAMESTATE_NAME, Gamestate_PostLoad)
+#define Gamestate_Start GAMESTATE_SYMBOL(GAMESTATE_NAME, Gamestate_Start)
+#define Gamestate_Pause GAMESTATE_SYMBOL(GAMESTATE_NAME, Gamestate_Pause)
+#define Gamestate_Resume GAMESTATE_SYMBOL(GAMESTATE_NAME, Gamestate_Resume)
+#define Gamestate_Stop GAMESTATE_SYMBOL(GAMESTATE_NAME, Gamestate_Stop)
+#define Gamestate_Unload GAMESTATE_SYMBOL(GAMESTATE_NAME, Gamestate_Unload)
+#define Gamestate_ProcessEvent GAMESTATE_SYMBOL(GAMESTATE_NAME, Gamestate_ProcessEvent)
+#define Gamestate_Reload GAMESTATE_SYMBOL(GAMESTATE_NAME, Gamestate_Reload)
+#define Gamestate_ProgressCount GAMESTATE_SYMBOL(GAMESTATE_NAME, Gamestate_ProgressCount)
+#endif
+
+#define OVERDRAW_MAX_LAYERS 32
+
+struct Overdraw {
+	bool enabled, dump;
+	bool recording; // between BeginOverdraw and FinishOverdraw
+	ALLEGRO_BITMAP* target; // the framebuffer or the canvas standing in for it, set by SetCanvasAsTarget
+	ALLEGRO_BITMAP *heatmap, *view;
+	ALLEGRO_FONT* font;
+	struct {
+		const char* name;
+		double pixels;
+	} layers[OVERDRAW_MAX_LAYERS];
+	int count;
+};
+
+#define PREWARM_MAX_ASSETS 64
+
+struct PrewarmAsset {
+	char *name, *path;
+	enum {
+		PREWARM_QUEUED,
+		PREWARM_LOADING,
+		PREWARM_READY,
+		PREWARM_FAILED, // or taken over by the gamestate before the worker got to it
+		PREWARM_CLAIMED, // handed over to the gamestate; failed and claimed slots get reused
+	} state;
+	ALLEGRO_BITMAP* bitmap; // memory bitmap
+	void* buffer; // raw file contents, for audio streams
+	int64_t size;
+	size_t bytes; // counted against the memory cap
+	unsigned int order; // of the request, as reused slots can be anywhere
+};
+
+struct Prewarm {
+	ALLEGRO_THREAD* thread;
+	ALLEGRO_MUTEX* mutex;
+	ALLEGRO_COND* cond;
+	struct PrewarmAsset assets[PREWARM_MAX_ASSETS];
+	struct PrewarmAsset* busy; // looked at by the worker with the mutex unlocked, not to be reused
+	int count;
+	unsigned int requests;
+	size_t used, limit;
+};
+
+struct LoadingAsset {
+	char* name;
+	int64_t bytes; // on disk
+	bool loaded;
+};
+
+struct LoadingProgress {
+	ALLEGRO_MUTEX* mutex;
+	struct LoadingAsset* assets; // see ExpectLoadingAssets
+	int count;
+	int64_t bytes, total;
+};
+
+struct AssetRecord {
+	char* name;
+	char gamestates[128]; // space separated
+	bool mask; // loaded with LoadMaskBitmap, see MarkMaskAsset
+};
+
+struct AssetReport {
+	bool enabled, written;
+	ALLEGRO_MUTEX* mutex; // gamestates get loaded on another thread
+	const char* output;
+	const char* scope; // gamestate being loaded
+	struct AssetRecord* records;
+	int count;
+};
+
+struct TieredAsset {
+	char *name, *variant;
+};
+
+struct AssetTiers {
+	const char* name; // directory of the selected tier
+	struct TieredAsset* assets;
+	int count;
+};
+
+#define TRACE_MAX_EVENTS (1 << 20)
+
+struct TraceEvent {
+	char phase; // X for spans, i for instants, M for thread names
+	char name[64];
+	int thread;
+	double start, duration;
+};
+
+struct Trace {
+	bool enabled;
+	const char* output;
+	ALLEGRO_MUTEX* mutex;
+	double origin;
+	struct TraceEvent* events;
+	int count, size, threads;
+};
+
+enum {
+	REPLAY_TICK,
+	REPLAY_KEY,
+	REPLAY_TOUCH,
+	REPLAY_AXIS
+};
+
+struct ReplayRecord {
+	uint32_t tick; // number of ticks simulated before this record
+	uint16_t kind;
+	uint16_t code; // keycode
+	float value; // touch position relative to display width, or joystick axis position
+	uint32_t hash; // simulation state after the tick
+	double time; // beat at the tick, or how long before the tick the input arrived
+};
+
+struct Replay {
+	const char* filename;
+	FILE* file;
+	bool recording, replaying, diverged;
+	uint32_t tick;
+	struct ReplayRecord next;
+	bool pending;
+};
+
+struct Headless {
+	bool enabled;
+	const char* output;
+	FILE* out;
+	int frames, limit; // limit set by --frames, 0 for none
+	double start, sum, max;
+};
+
+#define EXPORT_FPS 60
+
+struct Export {
+	bool enabled;
+	bool stepping; // StepExport is running Logic and Tick
+	const char* prefix;
+	FILE *video, *audio;
+	uint8_t* planes;
+	void* samples; // one frame worth of audio
+	int width, height, sample_size;
+	ALLEGRO_MUTEX* mutex; // guards the ring
+	ALLEGRO_COND* captured;
+	uint8_t* ring; // mixed on the audio thread, waiting for its frame
+	size_t ring_size, ring_start, ring_used; // in bytes
+	double time; // on the al_get_time() scale, see GetClock
+	long frames;
+	uint32_t audio_bytes;
+};
+
+#define RANDOM_MAX 0x7fffffff
+
+#define SPECTRUM_SIZE 1024 // samples per transform, a power of two
+#define SPECTRUM_HOP 512 // new samples between transforms
+#define SPECTRUM_BANDS 6
+
+struct SpectrumFrame {
+	float bands[SPECTRUM_BANDS]; // energy relative to the recent peak of each band, 0-1
+	unsigned int onsets; // counts up with every onset detected
+};
+
+struct Spectrum {
+	bool enabled;
+	int channels, depth, frequency;
+	int edges[SPECTRUM_BANDS + 1]; // band boundaries in bins
+	float input[SPECTRUM_SIZE]; // ring of the most recent mono samples
+	int position, pending;
+	float window[SPECTRUM_SIZE];
+	int reverse[SPECTRUM_SIZE];
+	float twiddle_re[SPECTRUM_SIZE], twiddle_im[SPECTRUM_SIZE];
+	float re[SPECTRUM_SIZE], im[SPECTRUM_SIZE];
+	float magnitudes[SPECTRUM_SIZE / 2];
+	float peaks[SPECTRUM_BANDS], flux_mean;
+	long holdoff; // samples until another onset can be detected
+	struct SpectrumFrame current, published;
+	unsigned int sequence; // odd while published is being written, 0 until the first one
+	double cost_max;
+};
+
+enum {
+	RESOURCE_BITMAP,
+	RESOURCE_SAMPLE,
+	RESOURCE_SAMPLE_INSTANCE,
+	RESOURCE_STREAM,
+	RESOURCE_FONT,
+	RESOURCE_TYPES
+};
+
+enum {
+	PARTICLE_X,
+	PARTICLE_Y,
+	PARTICLE_VX,
+	PARTICLE_VY,
+	PARTICLE_GRAVITY,
+	PARTICLE_DRAG,
+	PARTICLE_SIZE,
+	PARTICLE_LIFE, // seconds left
+	PARTICLE_TTL, // seconds it was born with
+	PARTICLE_R,
+	PARTICLE_G,
+	PARTICLE_B,
+	PARTICLE_A,
+	PARTICLE_FIELDS
+};
+
+#define PARTICLE_BATCH 4096 // particles per draw call
+
+struct ParticleStyle {
+	float r, g, b, a;
+	float direction, spread; // in radians, 0 pointing right and pi / 2 down
+	float speed; // pixels per second
+	float area; // side of the square particles get scattered over
+	float gravity; // pixels per second squared
+	float drag; // fraction of speed lost per second
+	float size; // pixels
+	float life; // seconds
+};
+
+struct Particles {
+	int count, capacity;
+	float* fields[PARTICLE_FIELDS]; // capacity floats each
+	float* block;
+	ALLEGRO_VERTEX* vertices;
+	int* indices;
+	uint32_t rng; // for the scatter, nothing here is part of the simulation
+};
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+struct Arena {
+	struct Game* game;
+	const char* name;
+	struct ArenaBlock* blocks;
+	struct ArenaCleanup* cleanups;
+	size_t used, reserved;
+};
+
 struct CommonResources {
 	// Fill in with common data accessible from all gamestates.
 	int score;
 	bool darkloading;
 	bool skiptoend;
+	float render_scale; // internal render resolution relative to 1920x1080
+	ALLEGRO_BITMAP* canvas; // see canvas.c
+	struct Overdraw overdraw;
+	struct Prewarm prewarm;
+	struct LoadingProgress loading;
+	struct AssetReport assets;
+	struct AssetTiers tiers;
+	ALLEGRO_SHADER* mask_shader; // see masks.c
+	struct Trace trace;
+	struct Replay replay;
+	struct Headless headless;
+	struct Export export;
+	struct Spectrum spectrum;
+	struct {
+		ALLEGRO_MUTEX* mutex; // gamestates are loaded on another thread
+		size_t bytes, peak; // over all gamestate arenas
+	} arenas;
+
+	bool focused, paused;
+	bool static_frame; // set by gamestates that had nothing new to draw this frame
+	double static_since;
+	double idle_fps, static_fps;
+	struct FrameCache* cache; // being drawn into, see BeginCachedFrame
+};
+
+#define STATIC_THROTTLE_DELAY 1.0 // seconds without changes before a static screen gets throttled
+
+struct FrameCache {
+	ALLEGRO_BITMAP* bitmap;
+	unsigned long long signature;
+	bool valid; // bitmap holds the frame for signature
+	bool direct; // the current frame is drawn straight into the framebuffer
+	double drawn; // when a frame was last drawn
+};
+
+#define HISTOGRAM_BUCKETS 100 // 1 ms each, the last one also collects everything above
+
+struct Histogram {
+	int buckets[HISTOGRAM_BUCKETS];
+	int count;
+	double sum, max;
+};
+
+#define GOVERNOR_WINDOW 30 // frames averaged before making a decision
+#define GOVERNOR_STEP_UP_DELAY 5.0 // seconds of headroom needed before raising quality
+
+struct Governor {
+	int level, levels; // 0 is the highest quality
+	bool automatic;
+	double budget;
+	double last, sum;
+	int frames;
+	double headroom, step_up_delay, last_step_up;
 };
 
 struct CommonResources* CreateGameData(struct Game* game);
 void DestroyGameData(struct Game* game);
 bool GlobalEventHandler(struct Game* game, ALLEGRO_EVENT* ev);
+void PreDrawHandler(struct Game* game);
+void PostDrawHandler(struct Game* game);
+void ResetHistogram(struct Histogram* histogram);
+void AddToHistogram(struct Histogram* histogram, double ms);
+double GetHistogramPercentile(struct Histogram* histogram, double percentile);
+void PrintHistogram(struct Game* game, struct Histogram* histogram, char* name);
+ALLEGRO_BITMAP* CreateRenderTarget(struct Game* game, int width, int height, float scale);
+void DrawRenderTarget(ALLEGRO_BITMAP* bitmap, float x, float y, float width, float height);
+void DrawLayer(struct Game* game, const char* name, ALLEGRO_BITMAP* bitmap, float x, float y);
+void DrawTintedLayer(struct Game* game, const char* name, ALLEGRO_BITMAP* bitmap, ALLEGRO_COLOR tint, float x, float y);
+void DrawRotatedLayer(struct Game* game, const char* name, ALLEGRO_BITMAP* bitmap, float cx, float cy, float dx, float dy, float angle);
+bool BeginCachedFrame(struct Game* game, struct FrameCache* cache, unsigned long long signature);
+void FinishCachedFrame(struct Game* game, struct FrameCache* cache);
+void InvalidateFrameCache(struct FrameCache* cache);
+void DestroyFrameCache(struct FrameCache* cache);
+void InitGovernor(struct Game* game, struct Governor* governor, int levels, const char* setting);
+bool UpdateGovernor(struct Governor* governor);
+void BeginOverdraw(struct Game* game);
+void RecordOverdraw(struct Game* game, const char* name, float x, float y, float width, float height);
+void RecordOverdrawQuad(struct Game* game, const char* name, float* points);
+void FinishOverdraw(struct Game* game);
+void DestroyOverdraw(struct Game* game);
+void PrewarmGamestate(struct Game* game, const char* name);
+ALLEGRO_BITMAP* LoadPrewarmedBitmap(struct Game* game, const char* filename);
+ALLEGRO_AUDIO_STREAM* LoadPrewarmedAudioStream(struct Game* game, const char* filename, size_t buffer_count, unsigned int samples);
+void DestroyPrewarm(struct Game* game);
+void ExpectLoadingAssets(struct Game* game, const char* name);
+void CountLoadedAssets(struct Game* game, const char* name);
+double GetLoadingProgress(struct Game* game);
+void FinishLoadingProgress(struct Game* game);
+void DestroyLoadingProgress(struct Game* game);
+char* TrackDataFilePath(struct Game* game, const char* filename);
+void SetAssetScope(struct Game* game, const char* gamestate);
+void StartAssetReport(struct Game* game, const char* filename);
+void MarkMaskAsset(struct Game* game, const char* filename);
+void WriteAssetReport(struct Game* game);
+void DestroyAssetReport(struct Game* game);
+void StartTrace(struct Game* game, const char* filename);
+double BeginTrace(struct Game* game);
+void EndTrace(struct Game* game, const char* name, double start);
+void TraceInstant(struct Game* game, const char* name);
+void TraceDataFile(struct Game* game, const char* filename);
+double BeginLoadTrace(void);
+void EndLoadTrace(const char* path, double start);
+void NameTraceThread(struct Game* game, const char* name);
+void FinishTrace(struct Game* game);
+struct Arena* CreateArena(struct Game* game, const char* name);
+void* ArenaAlloc(struct Arena* arena, size_t size);
+void ArenaDefer(struct Arena* arena, void (*destroy)(void*), void* ptr);
+ALLEGRO_BITMAP* ArenaBitmap(struct Arena* arena, ALLEGRO_BITMAP* bitmap);
+void DestroyArena(struct Arena* arena);
+void CreateCanvas(struct Game* game);
+void SetCanvasAsTarget(struct Game* game);
+void BeginCanvasFrame(struct Game* game);
+void PresentCanvas(struct Game* game);
+void DestroyCanvas(struct Game* game);
+void PrepareHeadless(void);
+void StartHeadless(struct Game* game, const char* filename);
+void BeginHeadlessFrame(struct Game* game);
+void FinishHeadlessFrame(struct Game* game);
+void FinishHeadless(struct Game* game);
+void StartExport(struct Game* game, const char* prefix);
+void CaptureAudio(struct Game* game, void* buffer, unsigned int samples);
+double GetClock(struct Game* game);
+bool SkipEngineStep(struct Game* game);
+void StepExport(struct Game* game);
+void ExportFrame(struct Game* game);
+void FinishExport(struct Game* game);
+void StartReplay(struct Game* game, const char* filename, bool record);
+uint32_t BeginReplay(struct Game* game, uint32_t seed);
+void RecordReplayInput(struct Game* game, int kind, int code, float value, double ahead);
+bool ReplayInput(struct Game* game, struct ReplayRecord* record);
+bool ReplayTick(struct Game* game, double* beat);
+void FinishReplayTick(struct Game* game, double beat, uint32_t hash);
+void FinishReplay(struct Game* game);
+uint32_t HashState(uint32_t hash, const void* ptr, size_t size);
+int Random(uint32_t* state);
+void SetResourceScope(const char* gamestate);
+void NameTrackedResource(void* ptr, const char* file);
+void ReportResources(struct Game* game, const char* gamestate);
+void RegisterStaticGamestates(struct Game* game);
+void SelectAssetTier(struct Game* game);
+const char* TieredAssetName(struct Game* game, const char* filename);
+void DestroyAssetTiers(struct Game* game);
+ALLEGRO_SHADER* CreatePixelShader(struct Game* game, const char* source);
+ALLEGRO_BITMAP* CreateChannelBitmap(int width, int height, const uint8_t* values);
+void CreateMaskShader(struct Game* game);
+void DestroyMaskShader(struct Game* game);
+ALLEGRO_BITMAP* LoadMaskBitmap(struct Game* game, const char* filename);
+void BeginMaskDrawing(struct Game* game);
+void EndMaskDrawing(struct Game* game);
+void StartSpectrum(struct Game* game);
+bool ReadSpectrum(struct Game* game, struct SpectrumFrame* frame);
+void FinishSpectrum(struct Game* game);
+struct Particles* CreateParticles(int capacity);
+void EmitParticles(struct Particles* particles, const struct ParticleStyle* style, float x, float y, int count);
+void UpdateParticles(struct Particles* particles, float delta);
+void DrawParticles(struct Particles* particles);
+void ClearParticles(struct Particles* particles);
+void DestroyParticles(struct Particles* particles);
+ALLEGRO_BITMAP* TrackLoadBitmap(const char* filename);
+ALLEGRO_BITMAP* TrackCreateBitmap(int width, int height);
+ALLEGRO_BITMAP* TrackCreateNotPreservedBitmap(int width, int height);
+ALLEGRO_BITMAP* TrackCloneBitmap(ALLEGRO_BITMAP* bitmap);
+void TrackDestroyBitmap(ALLEGRO_BITMAP* bitmap);
+ALLEGRO_SAMPLE* TrackLoadSample(const char* filename);
+void TrackDestroySample(ALLEGRO_SAMPLE* sample);
+ALLEGRO_SAMPLE_INSTANCE* TrackCreateSampleInstance(ALLEGRO_SAMPLE* sample);
+void TrackDestroySampleInstance(ALLEGRO_SAMPLE_INSTANCE* instance);
+ALLEGRO_AUDIO_STREAM* TrackLoadAudioStream(const char* filename, size_t buffer_count, unsigned int samples);
+ALLEGRO_AUDIO_STREAM* TrackLoadAudioStreamF(ALLEGRO_FILE* file, const char* ident, size_t buffer_count, unsigned int samples);
+void TrackDestroyAudioStream(ALLEGRO_AUDIO_STREAM* stream);
+ALLEGRO_FONT* TrackLoadTtfFont(const char* filename, int size, int flags);
+ALLEGRO_FONT* TrackCreateBuiltinFont(void);
+void TrackDestroyFont(ALLEGRO_FONT* font);
+
+// Loading from files gets traced, see resources.c.
+#define al_load_bitmap(filename) TrackLoadBitmap(filename)
+#define al_load_sample(filename) TrackLoadSample(filename)
+#define al_load_audio_stream(filename, buffer_count, samples) TrackLoadAudioStream(filename, buffer_count, samples)
+#define al_load_ttf_font(filename, size, flags) TrackLoadTtfFont(filename, size, flags)
+
+#ifdef TRACK_RESOURCES
+// Debug builds keep track of every resource the game creates, see resources.c.
+#define al_create_bitmap(width, height) TrackCreateBitmap(width, height)
+#define CreateNotPreservedBitmap(width, height) TrackCreateNotPreservedBitmap(width, height)
+#define al_clone_bitmap(bitmap) TrackCloneBitmap(bitmap)
+#define al_destroy_bitmap(bitmap) TrackDestroyBitmap(bitmap)
+#define al_destroy_sample(sample) TrackDestroySample(sample)
+#define al_create_sample_instance(sample) TrackCreateSampleInstance(sample)
+#define al_destroy_sample_instance(instance) TrackDestroySampleInstance(instance)
+#define al_load_audio_stream_f(file, ident, buffer_count, samples) TrackLoadAudioStreamF(file, ident, buffer_count, samples)
+#define al_destroy_audio_stream(stream) TrackDestroyAudioStream(stream)
+#define al_create_builtin_font() TrackCreateBuiltinFont()
+#define al_destroy_font(font) TrackDestroyFont(font)
+#endif
@@ -0,0 +1,267 @@
+/*! \file export.c
+ *  \brief Y4M and WAV export of a running session.
+ */
+/*
+ * Copyright (c) Sebastian Krzyszkowiak <dos@dosowisko.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "common.h"
+#include <libsuperderpy.h>
+#include <string.h>
+
+// With --export, the session is rendered offline into a Y4M stream at EXPORT_FPS
+// and a WAV file next to it, however long each frame takes to draw. While that's
+// going on gamestates ignore the engine's Logic and Tick calls, which come on the
+// wall clock (see SkipEngineStep), and StepExport runs them itself right before
+// each frame gets drawn, for exactly one frame period.
+//
+// Audio still gets mixed by the voice, on the audio thread. The mixer's postprocess
+// callback hands every buffer over to the main thread, where each exported frame
+// takes exactly one frame period of it. Whenever the mixer gets more than
+// EXPORT_AUDIO_AHEAD frames ahead of the video it gets paused, so the music
+// doesn't run away from a slow renderer, and it gets resumed once the frames have
+// caught up.
+
+#define EXPORT_AUDIO_AHEAD 2
+#define EXPORT_AUDIO_TIMEOUT 1.0 // seconds to wait for the mixer before writing silence
+
+static const char* GAMESTATES[] = {"dosowisko", "holypangolin", "intro", "tutorial", "disco", "outro"};
+
+static void WriteWavHeader(FILE* out, int frequency, int channels, int depth, uint32_t bytes) {
+	uint16_t format = (depth == ALLEGRO_AUDIO_DEPTH_FLOAT32) ? 3 : 1; // IEEE float or PCM
+	uint16_t bits = (depth == ALLEGRO_AUDIO_DEPTH_FLOAT32) ? 32 : 16;
+	uint16_t align = channels * bits / 8;
+	uint32_t rate = frequency * align, chunk = 36 + bytes, fmt = 16;
+	uint16_t count = channels;
+	uint32_t freq = frequency;
+
+	fseek(out, 0, SEEK_SET);
+	fwrite("RIFF", 4, 1, out);
+	fwrite(&chunk, 4, 1, out);
+	fwrite("WAVEfmt ", 8, 1, out);
+	fwrite(&fmt, 4, 1, out);
+	fwrite(&format, 2, 1, out);
+	fwrite(&count, 2, 1, out);
+	fwrite(&freq, 4, 1, out);
+	fwrite(&rate, 4, 1, out);
+	fwrite(&align, 2, 1, out);
+	fwrite(&bits, 2, 1, out);
+	fwrite("data", 4, 1, out);
+	fwrite(&bytes, 4, 1, out);
+}
+
+void StartExport(struct Game* game, const char* prefix) {
+	// Needs the headless canvas, so it has to be called after CreateCanvas.
+	struct Export* export = &game->data->export;
+	char filename[255];
+	snprintf(filename, sizeof(filename), "%s.y4m", prefix);
+	export->video = fopen(filename, "wb");
+	if (!export->video) {
+		PrintConsole(game, "Could not write the video to %s", filename);
+		return;
+	}
+	export->width = al_get_bitmap_width(game->data->canvas);
+	export->height = al_get_bitmap_height(game->data->canvas);
+	fprintf(export->video, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", export->width, export->height, EXPORT_FPS);
+	export->planes = malloc(export->width * export->height * 3);
+
+	int depth = al_get_mixer_depth(game->audio.mixer);
+	int frequency = al_get_mixer_frequency(game->audio.mixer);
+	int channels = al_get_channel_count(al_get_mixer_channels(game->audio.mixer));
+	if ((depth == ALLEGRO_AUDIO_DEPTH_FLOAT32) || (depth == ALLEGRO_AUDIO_DEPTH_INT16)) {
+		snprintf(filename, sizeof(filename), "%s.wav", prefix);
+		export->audio = fopen(filename, "wb");
+		if (export->audio) {
+			WriteWavHeader(export->audio, frequency, channels, depth, 0);
+		} else {
+			PrintConsole(game, "Could not write the audio to %s", filename);
+		}
+	} else {
+		PrintConsole(game, "Mixer depth %d can't be exported, skipping audio", depth);
+	}
+	if (export->audio) {
+		export->sample_size = channels * al_get_audio_depth_size(depth);
+		export->samples = malloc((frequency / EXPORT_FPS + 1) * export->sample_size);
+		export->ring_size = frequency * export->sample_size; // a second is plenty
+		export->ring = malloc(export->ring_size);
+		export->mutex = al_create_mutex();
+		export->captured = al_create_cond();
+	}
+
+	export->prefix = prefix;
+	export->time = al_get_time();
+	export->enabled = true;
+}
+
+void CaptureAudio(struct Game* game, void* buffer, unsigned int samples) {
+	// Runs on the audio thread from the master mixer's postprocess callback, so it
+	// only copies the buffer and leaves writing it out to ExportFrame.
+	struct Export* export = &game->data->export;
+	if (!export->enabled || !export->audio) {
+		return;
+	}
+	al_lock_mutex(export->mutex);
+	size_t bytes = samples * export->sample_size;
+	if (bytes > export->ring_size - export->ring_used) {
+		bytes = export->ring_size - export->ring_used; // can't happen while the mixer gets paused in time
+	}
+	for (size_t i = 0; i < bytes;) {
+		size_t end = (export->ring_start + export->ring_used) % export->ring_size;
+		size_t chunk = (end >= export->ring_start) ? export->ring_size - end : export->ring_start - end;
+		chunk = (chunk < bytes - i) ? chunk : bytes - i;
+		memcpy(export->ring + end, (uint8_t*)buffer + i, chunk);
+		export->ring_used += chunk;
+		i += chunk;
+	}
+	al_signal_cond(export->captured);
+	al_unlock_mutex(export->mutex);
+}
+
+double GetClock(struct Game* game) {
+	// al_get_time, except when exporting, where time only passes frame by frame.
+	struct Export* export = &game->data->export;
+	return export->enabled ? export->time : al_get_time();
+}
+
+bool SkipEngineStep(struct Game* game) {
+	// Called by gamestates first thing in Logic and Tick, which return right away when
+	// it says so. That's the case for the engine's calls while exporting.
+	struct Export* export = game->data ? &game->data->export : NULL;
+	return export && export->enabled && !export->stepping;
+}
+
+void StepExport(struct Game* game) {
+	struct Export* export = &game->data->export;
+	if (!export->enabled) {
+		return;
+	}
+	export->stepping = true;
+	for (size_t i = 0; i < sizeof(GAMESTATES) / sizeof(GAMESTATES[0]); i++) {
+		struct Gamestate* gamestate = GetGamestate(game, GAMESTATES[i]);
+		if (!gamestate || !gamestate->loaded || !gamestate->started || gamestate->paused) {
+			continue;
+		}
+		if (gamestate->api->tick) {
+			gamestate->api->tick(game, gamestate->data);
+		}
+		if (gamestate->api->logic) {
+			gamestate->api->logic(game, gamestate->data, 1.0 / EXPORT_FPS);
+		}
+	}
+	export->stepping = false;
+	export->time += 1.0 / EXPORT_FPS;
+}
+
+static void WriteFrameAudio(struct Game* game) {
+	// Samples per frame are counted from the start, so frequencies not divisible by
+	// the frame rate don't drift.
+	struct Export* export = &game->data->export;
+	long frequency = al_get_mixer_frequency(game->audio.mixer);
+	size_t bytes = ((export->frames + 1) * frequency / EXPORT_FPS - export->frames * frequency / EXPORT_FPS) * export->sample_size;
+
+	al_lock_mutex(export->mutex);
+	bool waiting = export->ring_used < bytes;
+	al_unlock_mutex(export->mutex);
+	if (waiting) {
+		// Never called with the mutex held, as the audio thread holds the voice's lock
+		// while it waits for ours.
+		al_set_mixer_playing(game->audio.mixer, true);
+	}
+
+	ALLEGRO_TIMEOUT timeout;
+	al_init_timeout(&timeout, EXPORT_AUDIO_TIMEOUT);
+	al_lock_mutex(export->mutex);
+	while (export->ring_used < bytes) {
+		if (al_wait_cond_until(export->captured, export->mutex, &timeout)) {
+			break;
+		}
+	}
+	size_t available = (export->ring_used < bytes) ? export->ring_used : bytes;
+	for (size_t i = 0; i < available;) {
+		size_t chunk = export->ring_size - export->ring_start;
+		chunk = (chunk < available - i) ? chunk : available - i;
+		memcpy((uint8_t*)export->samples + i, export->ring + export->ring_start, chunk);
+		export->ring_start = (export->ring_start + chunk) % export->ring_size;
+		export->ring_used -= chunk;
+		i += chunk;
+	}
+	bool ahead = export->ring_used > bytes * EXPORT_AUDIO_AHEAD;
+	al_unlock_mutex(export->mutex);
+
+	if (available < bytes) {
+		PrintConsole(game, "Export: the mixer stalled at frame %ld, padding with silence", export->frames);
+		memset((uint8_t*)export->samples + available, 0, bytes - available);
+	}
+	if (ahead) {
+		al_set_mixer_playing(game->audio.mixer, false);
+	}
+	fwrite(export->samples, bytes, 1, export->audio);
+	export->audio_bytes += bytes;
+}
+
+static void ConvertFrame(struct Export* export, ALLEGRO_BITMAP* bitmap) {
+	// BT.601 limited range, planar 4:4:4
+	ALLEGRO_LOCKED_REGION* region = al_lock_bitmap(bitmap, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_READONLY);
+	int size = export->width * export->height;
+	uint8_t *Y = export->planes, *U = export->planes + size, *V = export->planes + size * 2;
+	for (int y = 0; y < export->height; y++) {
+		uint8_t* row = (uint8_t*)region->data + y * region->pitch;
+		for (int x = 0; x < export->width; x++) {
+			int r = row[x * 4], g = row[x * 4 + 1], b = row[x * 4 + 2];
+			int i = y * export->width + x;
+			Y[i] = (66 * r + 129 * g + 25 * b + 128) / 256 + 16;
+			U[i] = (-38 * r - 74 * g + 112 * b + 128) / 256 + 128;
+			V[i] = (112 * r - 94 * g - 18 * b + 128) / 256 + 128;
+		}
+	}
+	al_unlock_bitmap(bitmap);
+}
+
+void ExportFrame(struct Game* game) {
+	struct Export* export = &game->data->export;
+	if (!export->enabled) {
+		return;
+	}
+	ConvertFrame(export, game->data->canvas);
+	fprintf(export->video, "FRAME\n");
+	fwrite(export->planes, export->width * export->height * 3, 1, export->video);
+	if (export->audio) {
+		WriteFrameAudio(game);
+	}
+	export->frames++;
+}
+
+void FinishExport(struct Game* game) {
+	struct Export* export = &game->data->export;
+	if (!export->enabled) {
+		return;
+	}
+	export->enabled = false;
+	fclose(export->video);
+	free(export->planes);
+	if (export->audio) {
+		// the mixer callback has been removed by now, see DestroyGameData
+		int depth = al_get_mixer_depth(game->audio.mixer);
+		WriteWavHeader(export->audio, al_get_mixer_frequency(game->audio.mixer), al_get_channel_count(al_get_mixer_channels(game->audio.mixer)), depth, export->audio_bytes);
+		fclose(export->audio);
+		free(export->samples);
+		free(export->ring);
+		al_destroy_cond(export->captured);
+		al_destroy_mutex(export->mutex);
+	}
+	PrintConsole(game, "Export: %ld frames written to %s.y4m", export->frames, export->prefix);
+}
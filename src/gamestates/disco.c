@@ -23,12 +23,79 @@
 #include <libsuperderpy.h>
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
 
 #define NUMBER_OF_PAJONKS 50
+#define BEATS_PER_STEP 4 // every leg takes that many beats to lift and stomp
+#define LEG_RANGE 25.0
+#define LEG_SPEED (3.5 * 60) // per second
+#define TICK_LENGTH (1.0 / 60.0)
+#define MAX_TURNS 8 // direction changes of the active leg within a single tick
+#define PREWARM_DELAY 20.0 // seconds into the song before the outro starts decoding
+#define INPUT_QUEUE_SIZE 64
+#define DEFAULT_TEMPO 114.6 // BPM of startrek.flac, for when its beat grid is missing
+#define LIGHTS_HOLD 4 // beats a light pattern stays up before an onset may change it
+#define FACET_SLOTS 1024 // hash table for the colours of matryca.png, has to be a power of two
+#define MAX_BURSTS 16 // stomps and splats remembered for Gamestate_Draw, more than a frame ever sees
+#define PARTICLE_POOL 32768
+
+enum {
+	QUALITY_FULL,
+	QUALITY_NO_SHADING, // skip the tinted cien layer
+	QUALITY_STATIC_FOLIAGE, // don't rotate the leaves
+	QUALITY_RECT_LIGHTS, // cut floor lights straight out of the ball instead of masking them offscreen
+	QUALITY_NO_LIGHTS, // skip the floor light pattern altogether
+	QUALITY_LOW_RES, // render the remaining offscreen composite at half resolution
+	QUALITY_LEVELS
+};
+
+enum {
+	BURST_STOMP, // a leg hit the web
+	BURST_SPLAT, // and squashed a spider
+};
+
+struct Burst {
+	int kind;
+	float x, y;
+};
+
+struct Snapshot {
+	// Everything Gamestate_Draw needs from the simulation, published after every tick.
+	// Characters are copied by value, their spritesheets are shared and never change.
+	struct Character kula, dron, pajonczki[NUMBER_OF_PAJONKS];
+	bool dead[NUMBER_OF_PAJONKS];
+	float noga1, noga2, noga3, noga4;
+	float noga1x, noga2x, noga3x, noga4x;
+	float noga1y, noga2y, noga3y, noga4y;
+	float wind;
+	int shake, score;
+	double beat;
+	float discocount; // the ball's phase at that beat
+	bool skip, ended; // the simulation asks for the outro
+	struct Burst bursts[MAX_BURSTS];
+	unsigned int burst_count; // ever made, the latest one is at bursts[(burst_count - 1) % MAX_BURSTS]
+};
+
+struct LegTick {
+	// Motion of the active leg over one tick: it starts at from, heading right or
+	// left, and changes direction at every turn (in seconds since the tick began).
+	float* x; // the leg that moved, NULL until the first tick
+	float from;
+	bool right;
+	double turns[MAX_TURNS];
+	int count;
+};
+
+struct Input {
+	int kind, code; // see REPLAY_KEY and friends
+	float value;
+	double timestamp, arrival;
+};
 
 struct GamestateResources {
 	// This struct is for every resource allocated and used by your gamestate.
 	// It gets created on load and then gets passed around to all other function calls.
+	struct Game* game;
 	ALLEGRO_FONT* font;
 	int blink_counter;
 
@@ -49,7 +116,9 @@ struct GamestateResources {
 	} oops[17];
 
 	ALLEGRO_BITMAP *bg, *web;
-	ALLEGRO_BITMAP *disco[6], *matryca;
+	ALLEGRO_BITMAP* ball; // a single frame, shaded by ball_shader to make it spin
+	ALLEGRO_BITMAP* facets; // angle of each facet of the ball, made from matryca.png
+	ALLEGRO_SHADER* ball_shader;
 	ALLEGRO_BITMAP* duzepole;
 
 	struct {
@@ -65,14 +134,73 @@ struct GamestateResources {
 	float noga1x, noga2x, noga3x, noga4x;
 	float noga1y, noga2y, noga3y, noga4y;
 	bool noga1b, noga2b, noga3b, noga4b;
+	double sim_time; // moment represented by the current tick, on GetClock() scale
+	struct LegTick turns; // steering that arrived ahead of the next tick
+	struct LegTick moved; // the last tick, redone when steering arrives too late for it
+	uint32_t rng; // everything random in the simulation comes from here, so replays can reproduce it
+	double sim_beat; // beat the current tick is simulated at
+	bool skip, ended;
+	bool prewarmed;
+	struct Burst bursts[MAX_BURSTS];
+	unsigned int burst_count;
+
+	ALLEGRO_BITMAP *tmp, *tmp_lowres, *mask, *chleb;
 
-	ALLEGRO_BITMAP *tmp, *mask, *chleb;
+	struct Governor quality;
 
-	float discocount;
+	struct {
+		unsigned int onsets; // count last seen in the spectrum
+		int mode;
+		double changed; // beat of the last pattern change
+	} lights;
 
 	int shake;
 
 	float pole;
+
+	struct {
+		double* times;
+		int count;
+		double tempo, offset;
+	} grid;
+
+	double clock; // music position in seconds, smoothed against the stream position
+	double latency;
+	double beat;
+	int step;
+
+	struct {
+		// Shared between the simulation thread and the main one, guarded by the mutex.
+		ALLEGRO_THREAD* thread;
+		ALLEGRO_MUTEX* mutex;
+		struct Snapshot published;
+		struct Input inputs[INPUT_QUEUE_SIZE];
+		int input_count;
+		double beat; // latest beat according to the audio clock
+		bool paused;
+	} sim;
+	struct Snapshot snapshot; // the one being drawn, main thread only
+	struct FrameCache frame; // only ever reused while paused or throttled
+	unsigned long long frames;
+
+	struct Particles* particles; // cosmetic only, so they live on the main thread
+	unsigned int bursts_seen;
+
+	struct {
+		// input-to-photon measurement, enabled with latency_test config option
+		// stage and timestamps are guarded by sim.mutex
+		bool enabled;
+		enum {
+			LAG_IDLE,
+			LAG_INPUT, // leg steered, waiting for a tick to move it
+			LAG_TICK, // leg moved, waiting for a frame to show it
+			LAG_DRAWN, // frame drawn, waiting for it to be flipped
+		} stage;
+		double input, arrival, tick, draw;
+		struct Histogram queue_hist, tick_hist, draw_hist, flip_hist, total_hist;
+	} lag;
+
+	struct Arena* arena;
 };
 
 struct PajonkData {
@@ -86,10 +214,16 @@ struct PajonkData {
 	bool dead;
 };
 
-int Gamestate_ProgressCount = 264 + NUMBER_OF_PAJONKS; // number of loading steps as reported by Gamestate_Load
+int Gamestate_ProgressCount = 258 + NUMBER_OF_PAJONKS; // number of loading steps as reported by Gamestate_Load
+
+static void AddBurst(struct GamestateResources* data, int kind, float x, float y) {
+	data->bursts[data->burst_count++ % MAX_BURSTS] = (struct Burst){kind, x, y};
+}
 
-void CheckCollision(struct Game* game, struct GamestateResources* data, int x, int y) {
+static void CheckCollision(struct Game* game, struct GamestateResources* data, int x, int y) {
+	double trace = BeginTrace(game);
 	bool dead = false;
+	AddBurst(data, BURST_STOMP, x + 22, y + 6);
 	for (int i = 0; i < NUMBER_OF_PAJONKS; i++) {
 		if (IsOnCharacter(game, data->pajonczki[i], x + 22, y + 6, false)) {
 			SelectSpritesheet(game, data->pajonczki[i], "dead");
@@ -98,14 +232,15 @@ void CheckCollision(struct Game* game, struct GamestateResources* data, int x, i
 				game->data->score++;
 				d->dead = true;
 				dead = true;
+				AddBurst(data, BURST_SPLAT, data->pajonczki[i]->x, data->pajonczki[i]->y);
 			}
 		}
 	}
 	al_play_sample_instance(data->boom);
-	data->shake = rand() % 10 + 25;
+	data->shake = Random(&data->rng) % 10 + 25;
 	if (dead) {
 		al_play_sample_instance(data->death);
-		int r = rand() % 17;
+		int r = Random(&data->rng) % 17;
 		int i = r + 1;
 		do {
 			if (i > 16) {
@@ -124,15 +259,319 @@ void CheckCollision(struct Game* game, struct GamestateResources* data, int x, i
 		al_play_sample_instance(data->oops[i].sound);
 		data->oops[i].used = true;
 	}
+	EndTrace(game, "CheckCollision", trace);
+}
+
+static void GetActiveLeg(struct GamestateResources* data, bool** right, float** x) {
+	if (data->nozka == 1) {
+		*right = &data->noga1b;
+		*x = &data->noga1x;
+	} else if (data->nozka == 2) {
+		*right = &data->noga2b;
+		*x = &data->noga2x;
+	} else if (data->nozka == 3) {
+		*right = &data->noga3b;
+		*x = &data->noga3x;
+	} else {
+		*right = &data->noga4b;
+		*x = &data->noga4x;
+	}
 }
 
-void Gamestate_Logic(struct Game* game, struct GamestateResources* data, double delta) {}
+static void MoveLeg(float* x, bool right, double duration) {
+	*x += (right ? 1 : -1) * LEG_SPEED * duration;
+	if (*x > LEG_RANGE) {
+		*x = LEG_RANGE;
+	}
+	if (*x < -LEG_RANGE) {
+		*x = -LEG_RANGE;
+	}
+}
 
-void Gamestate_Tick(struct Game* game, struct GamestateResources* data) {
-	// Called 60 times per second. Here you should do all your game logic.
+static float IntegrateLeg(const struct LegTick* tick) {
+	// Position at the end of the tick, clamped at the range on every segment like the real leg.
+	float x = tick->from;
+	bool right = tick->right;
+	double time = 0;
+	for (int i = 0; i < tick->count; i++) {
+		MoveLeg(&x, right, tick->turns[i] - time);
+		time = tick->turns[i];
+		right = !right;
+	}
+	MoveLeg(&x, right, TICK_LENGTH - time);
+	return x;
+}
+
+static void AddTurn(struct LegTick* tick, double time) {
+	if (tick->count == MAX_TURNS) {
+		// Can't happen at human speed. Dropping the last turn flips the final direction
+		// just like adding one would, so the leg still ends up heading the right way.
+		tick->count--;
+		return;
+	}
+	int i = tick->count++;
+	while (i > 0 && tick->turns[i - 1] > time) {
+		tick->turns[i] = tick->turns[i - 1];
+		i--;
+	}
+	tick->turns[i] = time;
+}
+
+static void Steer(struct Game* game, struct GamestateResources* data, bool right, double timestamp, double arrival) {
+	bool* noga;
+	float* x;
+	GetActiveLeg(data, &noga, &x);
+	if (*noga == right) {
+		return;
+	}
+	*noga = right;
+
+	// Integrate the leg from the exact moment of input instead of the tick boundary.
+	double ahead = data->sim_time - timestamp;
+	if ((ahead > 0) && (data->moved.x == x)) {
+		// already simulated past the input with the old direction, so redo the last tick with the turn in it
+		AddTurn(&data->moved, TICK_LENGTH - fmin(ahead, TICK_LENGTH));
+		*x = IntegrateLeg(&data->moved);
+	} else {
+		AddTurn(&data->turns, fmin(fmax(-ahead, 0), TICK_LENGTH));
+	}
+
+	al_lock_mutex(data->sim.mutex);
+	if (data->lag.enabled && data->lag.stage == LAG_IDLE) {
+		data->lag.input = timestamp;
+		data->lag.arrival = arrival;
+		data->lag.stage = LAG_INPUT;
+	}
+	al_unlock_mutex(data->sim.mutex);
+}
+
+static void HandleInput(struct Game* game, struct GamestateResources* data, int kind, int code, float value, double timestamp, double arrival) {
+	if ((kind == REPLAY_KEY) && (code == ALLEGRO_KEY_ESCAPE)) {
+		data->skip = true;
+	}
+
+	if (((kind == REPLAY_KEY) && (code == ALLEGRO_KEY_LEFT)) ||
+		((kind == REPLAY_TOUCH) && (value < 0.5)) ||
+		((kind == REPLAY_AXIS) && (value < -0.5))) {
+		Steer(game, data, false, timestamp, arrival);
+	}
+	if (((kind == REPLAY_KEY) && (code == ALLEGRO_KEY_RIGHT)) ||
+		((kind == REPLAY_TOUCH) && (value >= 0.5)) ||
+		((kind == REPLAY_AXIS) && (value > 0.5))) {
+		Steer(game, data, true, timestamp, arrival);
+	}
+}
+
+static double GetBeatValue(ALLEGRO_CONFIG* config, const char* section, const char* key, double fallback) {
+	const char* value = config ? al_get_config_value(config, section, key) : NULL;
+	return value ? atof(value) : fallback;
+}
+
+static void LoadBeatGrid(struct Game* game, struct GamestateResources* data, char* filename) {
+	// Without the file (or some of its keys) beats get extrapolated from the song's known tempo.
+	ALLEGRO_CONFIG* config = al_load_config_file(GetDataFilePath(game, filename));
+	if (!config) {
+		PrintConsole(game, "Could not load beat grid %s, using default tempo", filename);
+	}
+
+	data->grid.tempo = GetBeatValue(config, "beats", "tempo", DEFAULT_TEMPO);
+	data->grid.offset = GetBeatValue(config, "beats", "offset", 0.0);
+	if (data->grid.tempo <= 0) {
+		data->grid.tempo = DEFAULT_TEMPO;
+	}
+
+	char key[16];
+	data->grid.count = 0;
+	snprintf(key, 16, "%d", data->grid.count);
+	while (config && al_get_config_value(config, "grid", key)) {
+		data->grid.count++;
+		snprintf(key, 16, "%d", data->grid.count);
+	}
+
+	data->grid.times = ArenaAlloc(data->arena, sizeof(double) * (data->grid.count + 1));
+	for (int i = 0; i < data->grid.count; i++) {
+		snprintf(key, 16, "%d", i);
+		data->grid.times[i] = GetBeatValue(config, "grid", key, 0.0);
+	}
+
+	if (config) {
+		al_destroy_config(config);
+	}
+}
+
+static double BeatAt(struct GamestateResources* data, double time) {
+	double period = 60.0 / data->grid.tempo;
+	if (!data->grid.count) {
+		return (time - data->grid.offset) / period;
+	}
+	if (time < data->grid.times[0]) {
+		return (time - data->grid.times[0]) / period;
+	}
+
+	// find the last beat that isn't later than given time
+	int lo = 0, hi = data->grid.count - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (data->grid.times[mid] <= time) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	double next = (lo + 1 < data->grid.count) ? data->grid.times[lo + 1] : (data->grid.times[lo] + period);
+	return lo + (time - data->grid.times[lo]) / (next - data->grid.times[lo]);
+}
+
+static uint32_t HashSimulation(struct Game* game, struct GamestateResources* data) {
+	uint32_t hash = 2166136261u;
+	hash = HashState(hash, &game->data->score, sizeof(game->data->score));
+	hash = HashState(hash, &data->rng, sizeof(data->rng));
+	hash = HashState(hash, &data->nozka, sizeof(data->nozka));
+	hash = HashState(hash, &data->step, sizeof(data->step));
+	hash = HashState(hash, &data->shake, sizeof(data->shake));
+	float legs[] = {data->noga1, data->noga2, data->noga3, data->noga4, data->noga1x, data->noga2x, data->noga3x, data->noga4x};
+	bool directions[] = {data->noga1b, data->noga2b, data->noga3b, data->noga4b};
+	hash = HashState(hash, legs, sizeof(legs));
+	hash = HashState(hash, directions, sizeof(directions));
+	for (int i = 0; i < NUMBER_OF_PAJONKS; i++) {
+		struct PajonkData* d = data->pajonczki[i]->data;
+		hash = HashState(hash, &d->angle, sizeof(d->angle));
+		hash = HashState(hash, &d->angle_mod, sizeof(d->angle_mod));
+		hash = HashState(hash, &d->sin, sizeof(d->sin));
+		hash = HashState(hash, &d->dead, sizeof(d->dead));
+	}
+	return hash;
+}
+
+void Gamestate_Logic(struct Game* game, struct GamestateResources* data, double delta) {
+	if (SkipEngineStep(game)) {
+		return; // run by StepExport instead
+	}
+	// The stream position moves in whole fragments and runs ahead of what's audible,
+	// so advance the clock on our own and only pull it gently towards the stream.
+	data->clock += delta;
+	double drift = al_get_audio_stream_position_secs(data->music) - data->latency - data->clock;
+	if (fabs(drift) > 0.1) {
+		data->clock += drift; // rewind or underrun, resync right away
+	} else {
+		data->clock += drift * 0.05;
+	}
+	data->beat = fmax(BeatAt(data, data->clock), 0);
+
+	if (!data->prewarmed && data->clock > PREWARM_DELAY) {
+		PrewarmGamestate(game, "outro"); // the song can only end in one way
+		data->prewarmed = true;
+	}
+
+	al_lock_mutex(data->sim.mutex);
+	data->sim.beat = data->beat;
+	if (data->lag.stage == LAG_DRAWN) {
+		// we're in the next frame already, so the marked one has been flipped
+		double flip = al_get_time();
+		AddToHistogram(&data->lag.queue_hist, (data->lag.arrival - data->lag.input) * 1000);
+		AddToHistogram(&data->lag.tick_hist, (data->lag.tick - data->lag.arrival) * 1000);
+		AddToHistogram(&data->lag.draw_hist, (data->lag.draw - data->lag.tick) * 1000);
+		AddToHistogram(&data->lag.flip_hist, (flip - data->lag.draw) * 1000);
+		AddToHistogram(&data->lag.total_hist, (flip - data->lag.input) * 1000);
+		data->lag.stage = LAG_IDLE;
+	}
+	al_unlock_mutex(data->sim.mutex);
+
+	UpdateParticles(data->particles, delta);
+}
+
+static void PositionCharacters(struct Game* game, struct GamestateResources* data) {
+	for (int i = 0; i < NUMBER_OF_PAJONKS; i++) {
+		struct PajonkData* d = data->pajonczki[i]->data;
+		int centerx = 900, centery = 525;
+		//d->angle = data->wind; //(rand() / (float)RAND_MAX) * 2*ALLEGRO_PI;
+
+		int r = d->r + sin(d->sin) * 20;
+		int a = sin(d->angle + d->angle_mod) * r;
+		int b = cos(d->angle + d->angle_mod) * r;
+		int offset = d->dead ? 20 : 0;
+		SetCharacterPosition(game, data->pajonczki[i], centerx + b + offset, centery + a + offset, 0);
+
+		//SetCharacterPositionF(game, data->pajonczki[i], (rand() / (float)RAND_MAX) / 2.5 + 0.3 - 0.05, (rand() / (float)RAND_MAX) / 1.5 + 0.165, 0);
+	}
+	SetCharacterPositionF(game, data->dron, (775.0 + cos(data->wind * 5) * 3) / 1920.0, 268.0 / 1080.0, 0);
+}
+
+static void Publish(struct Game* game, struct GamestateResources* data) {
+	al_lock_mutex(data->sim.mutex);
+	struct Snapshot* snapshot = &data->sim.published;
+	snapshot->kula = *data->kula;
+	snapshot->dron = *data->dron;
+	for (int i = 0; i < NUMBER_OF_PAJONKS; i++) {
+		struct PajonkData* d = data->pajonczki[i]->data;
+		snapshot->pajonczki[i] = *data->pajonczki[i];
+		snapshot->dead[i] = d->dead;
+	}
+	snapshot->noga1 = data->noga1;
+	snapshot->noga2 = data->noga2;
+	snapshot->noga3 = data->noga3;
+	snapshot->noga4 = data->noga4;
+	snapshot->noga1x = data->noga1x;
+	snapshot->noga2x = data->noga2x;
+	snapshot->noga3x = data->noga3x;
+	snapshot->noga4x = data->noga4x;
+	snapshot->noga1y = data->noga1y;
+	snapshot->noga2y = data->noga2y;
+	snapshot->noga3y = data->noga3y;
+	snapshot->noga4y = data->noga4y;
+	snapshot->wind = data->wind;
+	snapshot->shake = data->shake;
+	snapshot->score = game->data->score;
+	snapshot->beat = data->sim_beat;
+	// the ball's phase, one band of light per beat; wrapped by whole turns to keep it precise
+	snapshot->discocount = 0.5 + data->sim_beat;
+	if (snapshot->discocount >= 6) {
+		snapshot->discocount = 1 + fmod(snapshot->discocount - 1, 5);
+	}
+	snapshot->skip = data->skip;
+	snapshot->ended = data->ended;
+	memcpy(snapshot->bursts, data->bursts, sizeof(data->bursts));
+	snapshot->burst_count = data->burst_count;
+	al_unlock_mutex(data->sim.mutex);
+}
+
+static void Simulate(struct Game* game, struct GamestateResources* data) {
+	// One tick of the game, run on the simulation thread (or by Tick when exporting).
+	double trace = BeginTrace(game);
 	double delta = 1.0 / 60.0;
+
+	struct Input inputs[INPUT_QUEUE_SIZE];
+	al_lock_mutex(data->sim.mutex);
+	int count = data->sim.input_count;
+	memcpy(inputs, data->sim.inputs, sizeof(struct Input) * count);
+	data->sim.input_count = 0;
+	data->sim_beat = data->sim.beat;
+	al_unlock_mutex(data->sim.mutex);
+
+	for (int i = 0; i < count; i++) {
+		RecordReplayInput(game, inputs[i].kind, inputs[i].code, inputs[i].value, data->sim_time - inputs[i].timestamp);
+		HandleInput(game, data, inputs[i].kind, inputs[i].code, inputs[i].value, inputs[i].timestamp, inputs[i].arrival);
+	}
+	struct ReplayRecord input;
+	while (ReplayInput(game, &input)) {
+		HandleInput(game, data, input.kind, input.code, input.value, data->sim_time - input.time, al_get_time());
+	}
+	if (!ReplayTick(game, &data->sim_beat)) {
+		data->ended = true; // the recorded session ends here
+		Publish(game, data);
+		EndTrace(game, "disco Tick", trace);
+		return;
+	}
+
 	data->blink_counter++;
 
+	al_lock_mutex(data->sim.mutex);
+	if (data->lag.stage == LAG_INPUT) {
+		data->lag.tick = al_get_time();
+		data->lag.stage = LAG_TICK;
+	}
+	al_unlock_mutex(data->sim.mutex);
+
 	if (data->shake) {
 		data->shake--;
 	}
@@ -145,33 +584,21 @@ void Gamestate_Tick(struct Game* game, struct GamestateResources* data) {
 	}
 	SetCharacterPosition(game, data->kula, 1200, -700 + 666 * pos, 0);
 
-	int range = 25;
-	float speed = 3.5;
-	if ((data->noga1b) && (data->noga1x < range) && (data->nozka == 1)) {
-		data->noga1x += speed;
-	}
-	if ((data->noga2b) && (data->noga2x < range) && (data->nozka == 2)) {
-		data->noga2x += speed;
-	}
-	if ((data->noga3b) && (data->noga3x < range) && (data->nozka == 3)) {
-		data->noga3x += speed;
-	}
-	if ((data->noga4b) && (data->noga4x < range) && (data->nozka == 4)) {
-		data->noga4x += speed;
+	data->sim_time += TICK_LENGTH;
+	if (fabs(GetClock(game) - data->sim_time) > 0.1) {
+		data->sim_time = GetClock(game); // we've been stalled, don't try to catch up
 	}
 
-	if ((!data->noga1b) && (data->noga1x > -range) && (data->nozka == 1)) {
-		data->noga1x -= speed;
-	}
-	if ((!data->noga2b) && (data->noga2x > -range) && (data->nozka == 2)) {
-		data->noga2x -= speed;
-	}
-	if ((!data->noga3b) && (data->noga3x > -range) && (data->nozka == 3)) {
-		data->noga3x -= speed;
-	}
-	if ((!data->noga4b) && (data->noga4x > -range) && (data->nozka == 4)) {
-		data->noga4x -= speed;
-	}
+	bool* right;
+	float* x;
+	GetActiveLeg(data, &right, &x);
+	// every turn has already flipped the leg's direction, so count them back to the starting one
+	data->turns.x = x;
+	data->turns.from = *x;
+	data->turns.right = (data->turns.count % 2) ? !*right : *right;
+	*x = IntegrateLeg(&data->turns);
+	data->moved = data->turns;
+	data->turns.count = 0;
 
 	data->wind += 0.0125;
 	for (int i = 0; i < NUMBER_OF_PAJONKS; i++) {
@@ -184,21 +611,17 @@ void Gamestate_Tick(struct Game* game, struct GamestateResources* data) {
 		d->sin += d->speed * 10.0;
 		AnimateCharacter(game, data->pajonczki[i], delta, 1);
 
-		if (rand() % 300 == 0) {
+		if (Random(&data->rng) % 300 == 0) {
 			d->angle += d->angle_mod;
 			d->angle_mod = 0;
 			//d->r = -d->r;
-			d->right = rand() % 2;
+			d->right = Random(&data->rng) % 2;
 			d->dead = false;
-			d->angle_range = (rand() / (float)RAND_MAX) * 0.33 + 0.1;
-			d->speed = (rand() / (float)RAND_MAX) * 0.005 + 0.005;
+			d->angle_range = (Random(&data->rng) / (float)RANDOM_MAX) * 0.33 + 0.1;
+			d->speed = (Random(&data->rng) / (float)RANDOM_MAX) * 0.005 + 0.005;
 		}
 	}
 	AnimateCharacter(game, data->dron, delta, 1);
-	data->discocount += 0.0318;
-	if (data->discocount >= 6) {
-		data->discocount -= 5;
-	}
 	data->pole += 0.05;
 	if (data->pole >= 20 * 6) {
 		data->pole = 0;
@@ -209,43 +632,106 @@ void Gamestate_Tick(struct Game* game, struct GamestateResources* data) {
 	//	al_draw_bitmap(data->shadow, 589 + 0 + data->noga1x, 285 + 115 + data->noga1y, 0);
 	//	al_draw_bitmap(data->shadow, 683 + 11 + data->noga2x, 379 + 160 + data->noga2y, 0);
 
-	if (data->nozka == 1) {
-		data->noga1 += 0.05;
-		if (data->noga1 > 2 * ALLEGRO_PI) {
-			data->nozka++;
-			data->noga1 -= 2 * ALLEGRO_PI;
-
-			CheckCollision(game, data, 589 + 0 + data->noga1x, 285 + 115 + data->noga1y);
+	// Legs are scheduled against the beat grid, so every stomp lands on the music.
+	int step = data->sim_beat / BEATS_PER_STEP;
+	float angle = (data->sim_beat / BEATS_PER_STEP - step) * 2 * ALLEGRO_PI;
+	if (step != data->step) {
+		bool landed = (step == data->step + 1); // otherwise the music has been rewound
+		if (data->nozka == 1) {
+			data->noga1 = 0;
+			if (landed) {
+				CheckCollision(game, data, 589 + 0 + data->noga1x, 285 + 115 + data->noga1y);
+			}
+		} else if (data->nozka == 2) {
+			data->noga2 = 0;
+			if (landed) {
+				CheckCollision(game, data, 683 + 7 + data->noga2x, 379 + 160 + data->noga2y);
+			}
+		} else if (data->nozka == 3) {
+			data->noga3 = 0;
+			if (landed) {
+				CheckCollision(game, data, 845 + 116 + data->noga3x, 150 + 100 + data->noga3y);
+			}
+		} else if (data->nozka == 4) {
+			data->noga4 = 0;
+			if (landed) {
+				CheckCollision(game, data, 887 + 195 + data->noga4x, 268 + 125 + data->noga4y);
+			}
 		}
-	} else if (data->nozka == 2) {
-		data->noga2 += 0.05;
-		if (data->noga2 > 2 * ALLEGRO_PI) {
-			data->nozka++;
-			data->noga2 -= 2 * ALLEGRO_PI;
+		data->nozka = step % 4 + 1;
+		data->step = step;
+	}
 
-			CheckCollision(game, data, 683 + 7 + data->noga2x, 379 + 160 + data->noga2y);
-		}
+	if (data->nozka == 1) {
+		data->noga1 = angle;
+	} else if (data->nozka == 2) {
+		data->noga2 = angle;
 	} else if (data->nozka == 3) {
-		data->noga3 += 0.05;
-		if (data->noga3 > 2 * ALLEGRO_PI) {
-			data->nozka++;
-			data->noga3 -= 2 * ALLEGRO_PI;
-
-			CheckCollision(game, data, 845 + 116 + data->noga3x, 150 + 100 + data->noga3y);
-		}
+		data->noga3 = angle;
 	} else if (data->nozka == 4) {
-		data->noga4 += 0.05;
-		if (data->noga4 > 2 * ALLEGRO_PI) {
-			data->nozka = 1;
-			data->noga4 -= 2 * ALLEGRO_PI;
+		data->noga4 = angle;
+	}
+
+	FinishReplayTick(game, data->sim_beat, HashSimulation(game, data));
+
+	PositionCharacters(game, data);
+	Publish(game, data);
+	EndTrace(game, "disco Tick", trace);
+}
 
-			CheckCollision(game, data, 887 + 195 + data->noga4x, 268 + 125 + data->noga4y);
+static void* Simulation(ALLEGRO_THREAD* thread, void* arg) {
+	// Runs the simulation at a fixed rate, independently from drawing.
+	struct GamestateResources* data = arg;
+	struct Game* game = data->game;
+	NameTraceThread(game, "simulation");
+
+	double next = al_get_time();
+	while (!al_get_thread_should_stop(thread)) {
+		al_lock_mutex(data->sim.mutex);
+		bool paused = data->sim.paused;
+		al_unlock_mutex(data->sim.mutex);
+
+		double now = al_get_time();
+		if (paused || data->ended) {
+			next = now + TICK_LENGTH;
 		}
+		if (now < next) {
+			al_rest(next - now);
+			continue;
+		}
+		next += TICK_LENGTH;
+		if (now - next > 0.1) {
+			next = now; // we've been stalled, don't try to catch up
+		}
+		Simulate(game, data);
+	}
+	return NULL;
+}
+
+void Gamestate_Tick(struct Game* game, struct GamestateResources* data) {
+	// Called 60 times per second. The game itself runs in Simulation, this only
+	// acts on its outcome on the main thread. Exports have no simulation thread, as
+	// they can't be left to the wall clock, so the tick runs here instead.
+	if (SkipEngineStep(game)) {
+		return; // run by StepExport instead
+	}
+	if (!data->sim.thread) {
+		Simulate(game, data);
 	}
+	al_lock_mutex(data->sim.mutex);
+	bool skip = data->sim.published.skip, ended = data->sim.published.ended;
+	int score = data->sim.published.score;
+	al_unlock_mutex(data->sim.mutex);
 
-	if (!al_get_audio_stream_playing(data->music)) {
-		if (game->data->score) {
+	if (skip) {
+		game->data->darkloading = true;
+		game->data->skiptoend = true;
+		TraceInstant(game, "switch to outro");
+		SwitchCurrentGamestate(game, "outro");
+	} else if (ended || (!game->data->replay.replaying && !al_get_audio_stream_playing(data->music))) {
+		if (ended || score) {
 			game->data->darkloading = true;
+			TraceInstant(game, "switch to outro");
 			SwitchCurrentGamestate(game, "outro");
 		} else {
 			al_rewind_audio_stream(data->music);
@@ -254,81 +740,75 @@ void Gamestate_Tick(struct Game* game, struct GamestateResources* data) {
 	}
 }
 
-void Gamestate_Draw(struct Game* game, struct GamestateResources* data) {
-	// Called as soon as possible, but no sooner than next Gamestate_Logic call.
-	// Draw everything to the screen here.
-	al_draw_bitmap(data->bg, -240 + sin(data->wind) * 4, -160, 0);
-
-	int shake = data->shake ? rand() % 10 : 0;
-
-	al_draw_bitmap(data->disco[(int)data->discocount], 480 + shake, 158 + sin(data->wind) * 4 + shake, 0);
-
-	int next = (int)data->discocount;
-	next--;
-	next += 6;
-	next++;
-	next++;
-	next = next % 6;
-	next++;
-
-	int prev = (data->blink_counter / 15) % 6 + 1;
-
-	//PrintConsole(game, "disco: %d, prev: %d, next: %d", (int)data->discocount, prev, next);
-
-	al_set_target_bitmap(data->tmp);
-	al_clear_to_color(al_map_rgba(0, 0, 0, 0));
-
-	al_draw_bitmap(data->disco[prev], 480 + shake, 158 + shake + sin(data->wind) * 4, 0);
-	al_set_blender(ALLEGRO_ADD, ALLEGRO_ZERO, ALLEGRO_ALPHA); // now as a mask
-	al_draw_bitmap(data->duzepole, 480 + shake, 158 + shake + sin(data->wind) * 4 + 2, 0);
-	al_set_blender(ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_INVERSE_ALPHA);
-
-	SetFramebufferAsTarget(game);
-	al_draw_bitmap(data->tmp, 0, 0, 0);
-
-	al_set_target_bitmap(data->tmp);
-	al_clear_to_color(al_map_rgba(0, 0, 0, 0));
-
-	al_draw_bitmap(data->disco[next], 480 + shake, 158 + shake + sin(data->wind) * 4, 0);
+static void DrawPole(struct Game* game, struct GamestateResources* data, int i, int j, float x, float y, bool rect) {
+	RecordOverdraw(game, "pola", data->pola[i][j].x1 + x, data->pola[i][j].y1 + y, al_get_bitmap_width(data->pola[i][j].bmp), al_get_bitmap_height(data->pola[i][j].bmp));
+	if (rect) {
+		al_draw_bitmap_region(data->ball, data->pola[i][j].x1, data->pola[i][j].y1,
+			al_get_bitmap_width(data->pola[i][j].bmp), al_get_bitmap_height(data->pola[i][j].bmp),
+			data->pola[i][j].x1 + x, data->pola[i][j].y1 + y, 0);
+	} else {
+		al_draw_bitmap(data->pola[i][j].bmp, data->pola[i][j].x1 + x, data->pola[i][j].y1 + y, 0);
+	}
+}
 
-	//int p = (int)data->pole;
-	//al_draw_bitmap(data->pola[p/6][p%6], 480, 158 + sin(data->wind) * 4, 0);
-	al_set_target_bitmap(data->mask);
-	al_clear_to_color(al_map_rgba(0, 0, 0, 0));
+static int ChooseLights(struct Game* game, struct GamestateResources* data, struct SpectrumFrame* spectrum, bool* live) {
+	// On an onset in the music the pattern changes to the one matching the loudest
+	// band, once the current one has been up for LIGHTS_HOLD beats. Without a
+	// spectrum the patterns simply follow the beat.
+	*live = ReadSpectrum(game, spectrum);
+	if (!*live) {
+		return (int)(data->snapshot.beat / 8) % 6;
+	}
+	if ((spectrum->onsets != data->lights.onsets) && (data->snapshot.beat - data->lights.changed >= LIGHTS_HOLD)) {
+		int loudest = 0;
+		for (int b = 1; b < SPECTRUM_BANDS; b++) {
+			if (spectrum->bands[b] > spectrum->bands[loudest]) {
+				loudest = b;
+			}
+		}
+		data->lights.mode = (loudest == data->lights.mode) ? (loudest + 1) % 6 : loudest;
+		data->lights.changed = data->snapshot.beat;
+	}
+	data->lights.onsets = spectrum->onsets;
+	return data->lights.mode;
+}
 
-	int blinkmode = (data->blink_counter / 252) % 6;
+static void DrawLights(struct Game* game, struct GamestateResources* data, float x, float y, bool rect) {
+	struct SpectrumFrame spectrum;
+	bool live;
+	int blinkmode = ChooseLights(game, data, &spectrum, &live);
 
 	if (blinkmode == 0) {
-		int p = (data->blink_counter / 4) % 20;
+		int p = (int)(data->snapshot.beat * 8) % 20;
 		for (int i = 0; i < 6; i++) {
-			al_draw_bitmap(data->pola[p][i].bmp, data->pola[p][i].x1 + 480 + shake, data->pola[p][i].y1 + 158 + shake + sin(data->wind) * 4, 0);
+			DrawPole(game, data, p, i, x, y, rect);
 		}
 	} else if (blinkmode == 1) {
-		int p = (data->blink_counter / 9) % 6;
+		int p = (int)(data->snapshot.beat * 4) % 6;
 		for (int i = 0; i < 20; i++) {
-			al_draw_bitmap(data->pola[i][p].bmp, data->pola[i][p].x1 + 480 + shake, data->pola[i][p].y1 + 158 + shake + sin(data->wind) * 4, 0);
+			DrawPole(game, data, i, p, x, y, rect);
 		}
 	} else if (blinkmode == 2) {
 		int k = 0;
 		for (int i = 0; i < 6; i++) {
 			for (int j = 0; j < 20; j++) {
-				if (k % 2 == (data->blink_counter / 25) % 2) {
-					al_draw_bitmap(data->pola[j][i].bmp, data->pola[j][i].x1 + 480 + shake, data->pola[j][i].y1 + 158 + shake + sin(data->wind) * 4, 0);
+				if (k % 2 == (live ? spectrum.onsets : (int)data->snapshot.beat) % 2) {
+					DrawPole(game, data, j, i, x, y, rect);
 				}
 				k++;
 			}
 		}
 	} else if (blinkmode == 3) {
-		int p = 5 - (data->blink_counter / 9) % 6;
+		int p = 5 - (int)(data->snapshot.beat * 4) % 6;
 		for (int i = 0; i < 20; i++) {
-			al_draw_bitmap(data->pola[i][p].bmp, data->pola[i][p].x1 + 480 + shake, data->pola[i][p].y1 + 158 + shake + sin(data->wind) * 4, 0);
+			DrawPole(game, data, i, p, x, y, rect);
 		}
 	} else if (blinkmode == 4) {
 		int k = 0;
 		for (int i = 0; i < 6; i++) {
 			for (int j = 0; j < 20; j++) {
-				if (k % 3 == (data->blink_counter / 18) % 3) {
-					al_draw_bitmap(data->pola[j][i].bmp, data->pola[j][i].x1 + 480 + shake, data->pola[j][i].y1 + 158 + shake + sin(data->wind) * 4, 0);
+				if (k % 3 == (int)(data->snapshot.beat * 2) % 3) {
+					DrawPole(game, data, j, i, x, y, rect);
 				}
 				k++;
 			}
@@ -337,8 +817,8 @@ void Gamestate_Draw(struct Game* game, struct GamestateResources* data) {
 		int k = 0;
 		for (int i = 0; i < 6; i++) {
 			for (int j = 0; j < 20; j++) {
-				if (i % 2) {
-					al_draw_bitmap(data->pola[j][i].bmp, data->pola[j][i].x1 + 480 + shake, data->pola[j][i].y1 + 158 + shake + sin(data->wind) * 4, 0);
+				if (live ? (spectrum.bands[i] > 0.5) : (i % 2)) { // one ring per band
+					DrawPole(game, data, j, i, x, y, rect);
 				}
 				k++;
 			}
@@ -347,132 +827,383 @@ void Gamestate_Draw(struct Game* game, struct GamestateResources* data) {
 
 	/*	for (int i=0; i<6; i++) {
 		for (int j=0; j<20; j++) {
-				al_draw_bitmap(data->pola[j][i].bmp, data->pola[j][i].x1 + 480 + shake, data->pola[j][i].y1 + 158 + shake + sin(data->wind) * 4, 0);
+				DrawPole(game, data, j, i, x, y, rect);
 		}
 	}*/
+}
 
-	al_set_target_bitmap(data->tmp);
-	al_set_blender(ALLEGRO_ADD, ALLEGRO_ZERO, ALLEGRO_ALPHA); // now as a mask
-	al_draw_bitmap(data->mask, 0, 0, 0);
-	al_set_blender(ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_INVERSE_ALPHA);
+// The ball is a single pre-rendered frame. Its facets get lit by a few bands of
+// light sweeping around the middle of the ball, one band width per beat, which
+// makes it spin in time with the music at any phase. Without shaders it stays
+// still.
+static const char* BALL_PIXEL_SHADER =
+	"#ifdef GL_ES\n"
+	"precision mediump float;\n"
+	"#endif\n"
+	"#define BANDS 3.0\n"
+	"#define DIM 0.45\n"
+	"#define BRIGHT 1.2\n"
+	"uniform sampler2D al_tex;\n"
+	"uniform sampler2D facets;\n"
+	"uniform float phase;\n"
+	"varying vec4 varying_color;\n"
+	"varying vec2 varying_texcoord;\n"
+	"void main() {\n"
+	"	float angle = texture2D(facets, varying_texcoord).r;\n"
+	"	float light = mix(DIM, BRIGHT, 0.5 + 0.5 * cos(6.2831853 * (angle * BANDS - phase)));\n"
+	"	vec4 color = texture2D(al_tex, varying_texcoord);\n"
+	"	gl_FragColor = varying_color * vec4(min(color.rgb * light, vec3(color.a)), color.a);\n"
+	"}\n";
+
+static ALLEGRO_BITMAP* CreateFacetMap(struct Game* game, const char* filename) {
+	// matryca.png paints every facet of the ball in its own colour. This turns it into
+	// a single channel map of where each facet sits around the middle of the ball, as
+	// a fraction of a full turn, so that a whole facet always gets lit at once.
+	// Pixels between facets take the facet to their left.
+	int flags = al_get_new_bitmap_flags();
+	al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+	ALLEGRO_BITMAP* source = LoadPrewarmedBitmap(game, filename);
+	al_set_new_bitmap_flags(flags);
+	if (!source) {
+		return NULL;
+	}
+	int width = al_get_bitmap_width(source), height = al_get_bitmap_height(source);
+	ALLEGRO_LOCKED_REGION* region = al_lock_bitmap(source, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_READONLY);
+	if (!region) {
+		al_destroy_bitmap(source);
+		return NULL;
+	}
+
+	struct {
+		uint32_t color; // 0 for an empty slot
+		double x, y;
+		int count;
+		uint8_t angle;
+	}* facets = calloc(FACET_SLOTS, sizeof(*facets));
+	int* slots = malloc(sizeof(int) * width * height); // -1 for pixels outside of the ball
+	double cx = 0, cy = 0;
+	int total = 0;
+	for (int y = 0; y < height; y++) {
+		uint8_t* row = (uint8_t*)region->data + y * region->pitch;
+		int slot = -1;
+		for (int x = 0; x < width; x++) {
+			uint32_t color = (row[x * 4] << 16) | (row[x * 4 + 1] << 8) | row[x * 4 + 2] | 0xff000000;
+			if (!row[x * 4 + 3]) {
+				slots[y * width + x] = slot = -1;
+				continue;
+			}
+			if (color != 0xffffffff) {
+				slot = ((color * 2654435761u) >> 16) & (FACET_SLOTS - 1);
+				while (facets[slot].color && (facets[slot].color != color)) {
+					slot = (slot + 1) & (FACET_SLOTS - 1);
+				}
+				facets[slot].color = color;
+				facets[slot].x += x;
+				facets[slot].y += y;
+				facets[slot].count++;
+				cx += x;
+				cy += y;
+				total++;
+			}
+			slots[y * width + x] = slot;
+		}
+	}
+	al_unlock_bitmap(source);
+	al_destroy_bitmap(source);
+	if (total) {
+		cx /= total;
+		cy /= total;
+	}
+
+	for (int slot = 0; slot < FACET_SLOTS; slot++) {
+		if (!facets[slot].count) {
+			continue;
+		}
+		double angle = atan2(facets[slot].y / facets[slot].count - cy, facets[slot].x / facets[slot].count - cx) / (2 * ALLEGRO_PI);
+		if (angle < 0) {
+			angle += 1.0;
+		}
+		facets[slot].angle = fmin(angle * 256, 255);
+	}
+	uint8_t* angles = malloc(width * height);
+	for (int i = 0; i < width * height; i++) {
+		angles[i] = (slots[i] >= 0) ? facets[slots[i]].angle : 0;
+	}
+	free(slots);
+	free(facets);
+
+	ALLEGRO_BITMAP* map = CreateChannelBitmap(width, height, angles);
+	free(angles);
+	return map;
+}
 
+static void BeginBallShading(struct GamestateResources* data, float phase) {
+	// Everything drawn from data->ball until EndBallShading gets lit at the given
+	// phase, in beats.
+	if (!data->ball_shader || !data->facets) {
+		return;
+	}
+	al_use_shader(data->ball_shader);
+	al_set_shader_sampler("facets", data->facets, 1);
+	al_set_shader_float("phase", phase);
+}
+
+static void EndBallShading(struct GamestateResources* data) {
+	if (data->ball_shader && data->facets) {
+		al_use_shader(NULL);
+	}
+}
+
+static void DrawFoliage(struct Game* game, struct GamestateResources* data, const char* name, ALLEGRO_BITMAP* bitmap, float cx, float cy, float dx, float dy, float angle) {
+	if (data->quality.level >= QUALITY_STATIC_FOLIAGE) {
+		DrawLayer(game, name, bitmap, dx - cx, dy - cy);
+	} else {
+		DrawRotatedLayer(game, name, bitmap, cx, cy, dx, dy, angle);
+	}
+}
+
+static const struct ParticleStyle DUST = {
+	.r = 0.6, .g = 0.55, .b = 0.5, .a = 0.6,
+	.direction = -ALLEGRO_PI / 2, .spread = ALLEGRO_PI, .speed = 160, .area = 30,
+	.gravity = 200, .drag = 2.5, .size = 6, .life = 0.6};
+static const struct ParticleStyle SPLAT = {
+	.r = 0.45, .g = 0.8, .b = 0.15, .a = 0.9,
+	.direction = 0, .spread = 2 * ALLEGRO_PI, .speed = 260, .area = 10,
+	.gravity = 600, .drag = 1.5, .size = 5, .life = 0.8};
+static const struct ParticleStyle DEBRIS = {
+	.r = 0.9, .g = 0.9, .b = 0.95, .a = 0.5,
+	.direction = ALLEGRO_PI / 2, .spread = 0.5, .speed = 40, .area = 6,
+	.gravity = 40, .drag = 0.5, .size = 2, .life = 2.0};
+
+static void EmitBursts(struct Game* game, struct GamestateResources* data) {
+	// Bursts published since the last frame. Frames that fell more than
+	// MAX_BURSTS behind only get the latest ones.
+	struct Snapshot* snapshot = &data->snapshot;
+	if (snapshot->burst_count - data->bursts_seen > MAX_BURSTS) {
+		data->bursts_seen = snapshot->burst_count - MAX_BURSTS;
+	}
+	int scale = (data->quality.level >= QUALITY_NO_LIGHTS) ? 2 : 1;
+	for (; data->bursts_seen != snapshot->burst_count; data->bursts_seen++) {
+		struct Burst* burst = &snapshot->bursts[data->bursts_seen % MAX_BURSTS];
+		if (burst->kind == BURST_STOMP) {
+			EmitParticles(data->particles, &DUST, burst->x, burst->y, 200 / scale);
+			// the whole web trembles and sheds some of what got stuck in it
+			for (int i = 0; i < 16 / scale; i++) {
+				float x = -38 + rand() / (float)RAND_MAX * al_get_bitmap_width(data->web);
+				float y = -160 + rand() / (float)RAND_MAX * al_get_bitmap_height(data->web) / 2.0;
+				EmitParticles(data->particles, &DEBRIS, x, y, 8);
+			}
+		} else {
+			EmitParticles(data->particles, &SPLAT, burst->x, burst->y, 400 / scale);
+		}
+	}
+}
+
+void Gamestate_Draw(struct Game* game, struct GamestateResources* data) {
+	// Called as soon as possible, but no sooner than next Gamestate_Logic call.
+	// Draw everything to the screen here.
+	double trace = BeginTrace(game);
 	SetFramebufferAsTarget(game);
-	al_draw_bitmap(data->tmp, 0, 0, 0);
+	al_lock_mutex(data->sim.mutex);
+	data->snapshot = data->sim.published;
+	al_unlock_mutex(data->sim.mutex);
+	struct Snapshot* snapshot = &data->snapshot;
+	EmitBursts(game, data);
+
+	if (!BeginCachedFrame(game, &data->frame, game->data->paused ? 0 : ++data->frames)) {
+		FinishCachedFrame(game, &data->frame);
+		EndTrace(game, "disco Draw", trace);
+		return;
+	}
+	if (data->frame.direct && UpdateGovernor(&data->quality)) {
+		// throttled frames say nothing about how fast we can draw
+		PrintConsole(game, "disco: quality level %d", data->quality.level);
+	}
+	BeginOverdraw(game);
 
-	al_draw_bitmap(data->web, -38 + shake, -160 + shake + sin(data->wind) * 4, 0);
+	DrawLayer(game, "bg", data->bg, -240 + sin(snapshot->wind) * 4, -160);
 
-	for (int i = 0; i < NUMBER_OF_PAJONKS; i++) {
-		struct PajonkData* d = data->pajonczki[i]->data;
-		if (!d->dead) continue;
-		int centerx = 900, centery = 525;
-		//d->angle = data->wind; //(rand() / (float)RAND_MAX) * 2*ALLEGRO_PI;
+	int shake = snapshot->shake ? rand() % 10 : 0;
+	float x = 480 + shake, y = 158 + shake + sin(snapshot->wind) * 4;
 
-		int r = d->r + sin(d->sin) * 20;
-		int a = sin(d->angle + d->angle_mod) * r;
-		int b = cos(d->angle + d->angle_mod) * r;
-		SetCharacterPosition(game, data->pajonczki[i], centerx + b + shake + 20, centery + a + shake + 20, 0);
+	BeginBallShading(data, snapshot->discocount);
+	DrawLayer(game, "disco", data->ball, x, y);
+	EndBallShading(data);
 
-		//SetCharacterPositionF(game, data->pajonczki[i], (rand() / (float)RAND_MAX) / 2.5 + 0.3 - 0.05, (rand() / (float)RAND_MAX) / 1.5 + 0.165, 0);
-		DrawCharacter(game, data->pajonczki[i]);
+	// the floor and the lights reflect the ball a bit further into its turn
+	float next = snapshot->discocount + 0.5, prev = snapshot->beat * 2;
+
+	ALLEGRO_BITMAP* tmp = (data->quality.level >= QUALITY_LOW_RES) ? data->tmp_lowres : data->tmp;
+	al_set_target_bitmap(tmp);
+	al_clear_to_color(al_map_rgba(0, 0, 0, 0));
+
+	BeginBallShading(data, prev);
+	DrawLayer(game, "disco", data->ball, x, y);
+	EndBallShading(data);
+	al_set_blender(ALLEGRO_ADD, ALLEGRO_ZERO, ALLEGRO_ALPHA); // now as a mask
+	BeginMaskDrawing(game);
+	DrawLayer(game, "duzepole", data->duzepole, x, y + 2);
+	EndMaskDrawing(game);
+	al_set_blender(ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_INVERSE_ALPHA);
+
+	SetFramebufferAsTarget(game);
+	DrawRenderTarget(tmp, 0, 0, 1920, 1080);
+	RecordOverdraw(game, "tmp", 0, 0, 1920, 1080);
+
+	if (data->quality.level < QUALITY_RECT_LIGHTS) {
+		al_set_target_bitmap(data->tmp);
+		al_clear_to_color(al_map_rgba(0, 0, 0, 0));
+
+		BeginBallShading(data, next);
+		DrawLayer(game, "disco", data->ball, x, y);
+		EndBallShading(data);
+
+		//int p = (int)data->pole;
+		//al_draw_bitmap(data->pola[p/6][p%6], 480, 158 + sin(snapshot->wind) * 4, 0);
+		al_set_target_bitmap(data->mask);
+		al_clear_to_color(al_map_rgba(0, 0, 0, 0));
+
+		BeginMaskDrawing(game);
+		DrawLights(game, data, x, y, false);
+		EndMaskDrawing(game);
+
+		al_set_target_bitmap(data->tmp);
+		al_set_blender(ALLEGRO_ADD, ALLEGRO_ZERO, ALLEGRO_ALPHA); // now as a mask
+		DrawRenderTarget(data->mask, 0, 0, 1920, 1080);
+		al_set_blender(ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_INVERSE_ALPHA);
+
+		SetFramebufferAsTarget(game);
+		DrawRenderTarget(data->tmp, 0, 0, 1920, 1080);
+		RecordOverdraw(game, "tmp", 0, 0, 1920, 1080);
+	} else if (data->quality.level < QUALITY_NO_LIGHTS) {
+		BeginBallShading(data, next);
+		al_hold_bitmap_drawing(true);
+		DrawLights(game, data, x, y, true);
+		al_hold_bitmap_drawing(false);
+		EndBallShading(data);
 	}
 
-	for (int i = 0; i < NUMBER_OF_PAJONKS; i++) {
-		struct PajonkData* d = data->pajonczki[i]->data;
-		if (d->dead) continue;
-		int centerx = 900, centery = 525;
-		//d->angle = data->wind; //(rand() / (float)RAND_MAX) * 2*ALLEGRO_PI;
+	DrawLayer(game, "web", data->web, -38 + shake, -160 + shake + sin(snapshot->wind) * 4);
 
-		int r = d->r + sin(d->sin) * 20;
-		int a = sin(d->angle + d->angle_mod) * r;
-		int b = cos(d->angle + d->angle_mod) * r;
-		SetCharacterPosition(game, data->pajonczki[i], centerx + b, centery + a, 0);
+	for (int i = 0; i < NUMBER_OF_PAJONKS; i++) {
+		if (!snapshot->dead[i]) continue;
+		struct Character* pajonczek = &snapshot->pajonczki[i];
+		SetCharacterPosition(game, pajonczek, pajonczek->x + shake, pajonczek->y + shake, 0);
+		DrawCharacter(game, pajonczek);
+	}
 
-		//SetCharacterPositionF(game, data->pajonczki[i], (rand() / (float)RAND_MAX) / 2.5 + 0.3 - 0.05, (rand() / (float)RAND_MAX) / 1.5 + 0.165, 0);
-		DrawCharacter(game, data->pajonczki[i]);
+	for (int i = 0; i < NUMBER_OF_PAJONKS; i++) {
+		if (snapshot->dead[i]) continue;
+		DrawCharacter(game, &snapshot->pajonczki[i]);
 	}
 
-	SetCharacterPositionF(game, data->dron, (775.0 + cos(data->wind * 5) * 3) / 1920.0, 268.0 / 1080.0, 0);
+	BeginMaskDrawing(game);
+	al_draw_bitmap(data->shadow, 845 + 116 + snapshot->noga3x, 150 + 100 + snapshot->noga3y, 0);
+	al_draw_bitmap(data->shadow, 887 + 195 + snapshot->noga4x, 268 + 125 + snapshot->noga4y, 0);
+	al_draw_bitmap(data->shadow, 589 + 0 + snapshot->noga1x, 285 + 115 + snapshot->noga1y, 0);
+	al_draw_bitmap(data->shadow, 683 + 7 + snapshot->noga2x, 379 + 160 + snapshot->noga2y, 0);
+	EndMaskDrawing(game);
 
-	al_draw_bitmap(data->shadow, 845 + 116 + data->noga3x, 150 + 100 + data->noga3y, 0);
-	al_draw_bitmap(data->shadow, 887 + 195 + data->noga4x, 268 + 125 + data->noga4y, 0);
-	al_draw_bitmap(data->shadow, 589 + 0 + data->noga1x, 285 + 115 + data->noga1y, 0);
-	al_draw_bitmap(data->shadow, 683 + 7 + data->noga2x, 379 + 160 + data->noga2y, 0);
+	al_draw_rotated_bitmap(data->nozka3, 12, 148, 845 + 12 + snapshot->noga3x, 150 + 148 + snapshot->noga3y, -(cos(snapshot->noga3 + ALLEGRO_PI) + 1) / 5.0, 0);
+	al_draw_rotated_bitmap(data->nozka4, 15, 108, 887 + 15 + snapshot->noga4x, 268 + 108 + snapshot->noga4y, -(cos(snapshot->noga4 + ALLEGRO_PI) + 1) / 5.0, 0);
+	DrawCharacter(game, &snapshot->dron);
+	al_draw_rotated_bitmap(data->nozka1, 234, 56, 589 + 234 + snapshot->noga1x, 285 + 56 + snapshot->noga1y, (cos(snapshot->noga1 + ALLEGRO_PI) + 1) / 5.0, 0);
+	al_draw_rotated_bitmap(data->nozka2, 175, 16, 683 + 175 + snapshot->noga2x, 376 + 16 + snapshot->noga2y, (cos(snapshot->noga2 + ALLEGRO_PI) + 1) / 5.0, 0);
 
-	al_draw_rotated_bitmap(data->nozka3, 12, 148, 845 + 12 + data->noga3x, 150 + 148 + data->noga3y, -(cos(data->noga3 + ALLEGRO_PI) + 1) / 5.0, 0);
-	al_draw_rotated_bitmap(data->nozka4, 15, 108, 887 + 15 + data->noga4x, 268 + 108 + data->noga4y, -(cos(data->noga4 + ALLEGRO_PI) + 1) / 5.0, 0);
-	DrawCharacter(game, data->dron);
-	al_draw_rotated_bitmap(data->nozka1, 234, 56, 589 + 234 + data->noga1x, 285 + 56 + data->noga1y, (cos(data->noga1 + ALLEGRO_PI) + 1) / 5.0, 0);
-	al_draw_rotated_bitmap(data->nozka2, 175, 16, 683 + 175 + data->noga2x, 376 + 16 + data->noga2y, (cos(data->noga2 + ALLEGRO_PI) + 1) / 5.0, 0);
+	DrawParticles(data->particles);
 
-	al_draw_bitmap(data->chleb, 775 + cos(data->wind * 5) * 3, 268, 0);
+	al_draw_bitmap(data->chleb, 775 + cos(snapshot->wind * 5) * 3, 268, 0);
 
-	data->kula->scaleX = 0.75;
-	data->kula->scaleY = 0.75;
-	DrawCharacter(game, data->kula);
+	DrawCharacter(game, &snapshot->kula);
 
-	al_draw_bitmap(data->listek03, 566, 598, 0);
-	al_draw_rotated_bitmap(data->roslinka04, 512, 1390, 1221 + 512, -100 + 1390, sin(data->wind / 2.0 + 2.34) / 50.0, 0);
-	al_draw_bitmap(data->wp05, -240, -160, 0);
+	DrawLayer(game, "listek03", data->listek03, 566, 598);
+	DrawFoliage(game, data, "roslinka04", data->roslinka04, 512, 1390, 1221 + 512, -100 + 1390, sin(snapshot->wind / 2.0 + 2.34) / 50.0);
+	DrawLayer(game, "wp05", data->wp05, -240, -160);
 
 	//al_draw_bitmap(data->listek1, 1065, 644,0);
-	al_draw_rotated_bitmap(data->listek1, 920, 430, 1065 + 920, 644 + 430, cos(data->wind + 1) / 60.0, 0);
+	DrawFoliage(game, data, "listek1", data->listek1, 920, 430, 1065 + 920, 644 + 430, cos(snapshot->wind + 1) / 60.0);
 
-	al_draw_rotated_bitmap(data->listek2, 0, 588, -94, 534 + 588, sin(data->wind / 1.5 + 5.298) / 20.0, 0);
+	DrawFoliage(game, data, "listek2", data->listek2, 0, 588, -94, 534 + 588, sin(snapshot->wind / 1.5 + 5.298) / 20.0);
 
 	//al_draw_bitmap(data->listek2, -94, 534,0);
 	//al_draw_bitmap(data->listek3, -94, -123,0);
-	al_draw_rotated_bitmap(data->listek3, 145, 40, -94 + 145, -123 + 40, sin(data->wind / 2.5 + 0.1234) / 30.0, 0);
+	DrawFoliage(game, data, "listek3", data->listek3, 145, 40, -94 + 145, -123 + 40, sin(snapshot->wind / 2.5 + 0.1234) / 30.0);
 
-	al_draw_tinted_bitmap(data->cien, al_map_rgba_f(0.1, 0.1, 0.1, 0.4), 1282, -363, 0);
+	if (data->quality.level < QUALITY_NO_SHADING) {
+		DrawTintedLayer(game, "cien", data->cien, al_map_rgba_f(0.1, 0.1, 0.1, 0.4), 1282, -363);
+	}
+
+	FinishOverdraw(game);
+
+	if (data->lag.enabled) {
+		// marker for a photodiode or high-speed camera, lit only on the first frame showing the change
+		al_lock_mutex(data->sim.mutex);
+		bool marker = (data->lag.stage == LAG_TICK);
+		if (marker) {
+			data->lag.draw = al_get_time();
+			data->lag.stage = LAG_DRAWN;
+		}
+		al_unlock_mutex(data->sim.mutex);
+		al_draw_filled_rectangle(0, 1080 - 64, 64, 1080, marker ? al_map_rgb(255, 255, 255) : al_map_rgb(0, 0, 0));
+		al_draw_textf(data->font, al_map_rgb(255, 255, 255), 80, 1080 - 40, ALLEGRO_ALIGN_LEFT, "queue p50<%.0f  tick p50<%.0f  draw p50<%.0f  flip p50<%.0f  total p50<%.0f p95<%.0f ms (n=%d)",
+			GetHistogramPercentile(&data->lag.queue_hist, 0.5), GetHistogramPercentile(&data->lag.tick_hist, 0.5),
+			GetHistogramPercentile(&data->lag.draw_hist, 0.5), GetHistogramPercentile(&data->lag.flip_hist, 0.5),
+			GetHistogramPercentile(&data->lag.total_hist, 0.5), GetHistogramPercentile(&data->lag.total_hist, 0.95),
+			data->lag.total_hist.count);
+	}
 
 	/*for (int i=0; i<17; i++) {
 		al_draw_filled_rectangle(100*i+100, 1080-100, 100*i+200, 1080, data->oops[i].used ? al_map_rgb(255,0,0) : al_map_rgb(255,255,255));
 		al_draw_rectangle(100*i+100, 1080-100, 100*i+200, 1080, al_map_rgb(0,0,0), 2);
 	}*/
+	FinishCachedFrame(game, &data->frame);
+	EndTrace(game, "disco Draw", trace);
 }
 
 void Gamestate_ProcessEvent(struct Game* game, struct GamestateResources* data, ALLEGRO_EVENT* ev) {
 	// Called for each event in Allegro event queue.
 	// Here you can handle user input, expiring timers etc.
-	if ((ev->type == ALLEGRO_EVENT_KEY_DOWN) && (ev->keyboard.keycode == ALLEGRO_KEY_ESCAPE)) {
-		game->data->darkloading = true;
-		game->data->skiptoend = true;
-		SwitchCurrentGamestate(game, "outro");
+	if (game->data->replay.replaying) {
+		return; // inputs come from the replay, see Simulate
 	}
 
-	if (((ev->type == ALLEGRO_EVENT_KEY_DOWN) && (ev->keyboard.keycode == ALLEGRO_KEY_LEFT)) ||
-		((ev->type == ALLEGRO_EVENT_TOUCH_BEGIN) && (ev->touch.x < al_get_display_width(game->display) / 2.0)) ||
-		((ev->type == ALLEGRO_EVENT_JOYSTICK_AXIS) && (ev->joystick.pos < -0.5))) {
-		if (data->nozka == 1) {
-			data->noga1b = false;
-		} else if (data->nozka == 2) {
-			data->noga2b = false;
-		} else if (data->nozka == 3) {
-			data->noga3b = false;
-		} else if (data->nozka == 4) {
-			data->noga4b = false;
-		}
+	int kind, code = 0;
+	float value = 0;
+	if (ev->type == ALLEGRO_EVENT_KEY_DOWN) {
+		kind = REPLAY_KEY;
+		code = ev->keyboard.keycode;
+	} else if (ev->type == ALLEGRO_EVENT_TOUCH_BEGIN) {
+		kind = REPLAY_TOUCH;
+		value = ev->touch.x / (float)al_get_display_width(game->display);
+	} else if (ev->type == ALLEGRO_EVENT_JOYSTICK_AXIS) {
+		kind = REPLAY_AXIS;
+		value = ev->joystick.pos;
+	} else {
+		return;
 	}
-	if (((ev->type == ALLEGRO_EVENT_KEY_DOWN) && (ev->keyboard.keycode == ALLEGRO_KEY_RIGHT)) ||
-		((ev->type == ALLEGRO_EVENT_TOUCH_BEGIN) && (ev->touch.x >= al_get_display_width(game->display) / 2.0)) ||
-		((ev->type == ALLEGRO_EVENT_JOYSTICK_AXIS) && (ev->joystick.pos > 0.5))) {
-		if (data->nozka == 1) {
-			data->noga1b = true;
-		} else if (data->nozka == 2) {
-			data->noga2b = true;
-		} else if (data->nozka == 3) {
-			data->noga3b = true;
-		} else if (data->nozka == 4) {
-			data->noga4b = true;
-		}
+
+	// handed over to the simulation thread, which also records it for replays
+	al_lock_mutex(data->sim.mutex);
+	if (data->sim.input_count < INPUT_QUEUE_SIZE) {
+		data->sim.inputs[data->sim.input_count++] = (struct Input){kind, code, value, ev->any.timestamp, al_get_time()};
 	}
+	al_unlock_mutex(data->sim.mutex);
 }
 
 void* Gamestate_Load(struct Game* game, void (*progress)(struct Game*)) {
 	// Called once, when the gamestate library is being loaded.
 	// Good place for allocating memory, loading bitmaps etc.
-
-	struct GamestateResources* data = malloc(sizeof(struct GamestateResources));
+	double trace = BeginTrace(game);
+
+	struct Arena* arena = CreateArena(game, "disco");
+	struct GamestateResources* data = ArenaAlloc(arena, sizeof(struct GamestateResources));
+	data->arena = arena;
+	data->particles = CreateParticles(PARTICLE_POOL);
+	data->frame = (struct FrameCache){0};
+	data->game = game;
+	data->sim.mutex = al_create_mutex();
+	SetAssetScope(game, "disco");
+	ExpectLoadingAssets(game, "disco");
 	data->font = al_create_builtin_font();
 
 	data->boom_sample = al_load_sample(GetDataFilePath(game, "boom.flac"));
@@ -488,51 +1219,50 @@ void* Gamestate_Load(struct Game* game, void (*progress)(struct Game*)) {
 	al_set_sample_instance_gain(data->death, 0.5);
 
 	for (int i = 0; i < 17; i++) {
-		char* filename = malloc(255 * sizeof(char));
+		char filename[255];
 		snprintf(filename, 255, "oops/%d.flac", i);
 
 		data->oops[i].sample = al_load_sample(GetDataFilePath(game, filename));
 		data->oops[i].sound = al_create_sample_instance(data->oops[i].sample);
 		al_attach_sample_instance_to_mixer(data->oops[i].sound, game->audio.voice);
 		al_set_sample_instance_playmode(data->oops[i].sound, ALLEGRO_PLAYMODE_ONCE);
-		free(filename);
 	}
 
 	data->pajonczek = CreateCharacter(game, "pajonczek");
 	RegisterSpritesheet(game, data->pajonczek, "stand");
 	RegisterSpritesheet(game, data->pajonczek, "dead");
 	LoadSpritesheets(game, data->pajonczek, progress);
+	CountLoadedAssets(game, "sprites/pajonczek"); // loaded by the engine
 
 	data->dron = CreateCharacter(game, "dron");
 	RegisterSpritesheet(game, data->dron, "dance");
 	LoadSpritesheets(game, data->dron, progress);
+	CountLoadedAssets(game, "sprites/dron");
 
 	data->kula = CreateCharacter(game, "kula");
 	RegisterSpritesheet(game, data->kula, "kula");
 	LoadSpritesheets(game, data->kula, progress);
+	CountLoadedAssets(game, "sprites/kula");
 
 	progress(game);
 
-	data->bg = al_load_bitmap(GetDataFilePath(game, "bg.png"));
+	data->bg = LoadPrewarmedBitmap(game, "bg.png");
 	progress(game);
-	data->web = al_load_bitmap(GetDataFilePath(game, "web.png"));
+	data->web = LoadPrewarmedBitmap(game, "web.png");
 	progress(game);
-	data->listek03 = al_load_bitmap(GetDataFilePath(game, "03listek.png"));
+	data->listek03 = LoadPrewarmedBitmap(game, "03listek.png");
 	progress(game);
-	data->roslinka04 = al_load_bitmap(GetDataFilePath(game, "04_roslinka.png"));
+	data->roslinka04 = LoadPrewarmedBitmap(game, "04_roslinka.png");
 	progress(game);
-	data->wp05 = al_load_bitmap(GetDataFilePath(game, "05_warstwa_posrednia.png"));
+	data->wp05 = LoadPrewarmedBitmap(game, "05_warstwa_posrednia.png");
 	progress(game);
-	data->listek1 = al_load_bitmap(GetDataFilePath(game, "06_lisc_zielony.png"));
+	data->listek1 = LoadPrewarmedBitmap(game, "06_lisc_zielony.png");
 	progress(game);
-	data->listek2 = al_load_bitmap(GetDataFilePath(game, "06_lisc_zielony2.png"));
+	data->listek2 = LoadPrewarmedBitmap(game, "06_lisc_zielony2.png");
 	progress(game);
-	data->listek3 = al_load_bitmap(GetDataFilePath(game, "06_zolty_lisc.png"));
+	data->listek3 = LoadPrewarmedBitmap(game, "06_zolty_lisc.png");
 	progress(game);
-	data->cien = al_load_bitmap(GetDataFilePath(game, "07_cien.png"));
-	progress(game);
-
-	data->matryca = al_load_bitmap(GetDataFilePath(game, "matryca.png"));
+	data->cien = LoadPrewarmedBitmap(game, "07_cien.png");
 	progress(game);
 
 	for (int i = 0; i < 20; i++) {
@@ -540,7 +1270,7 @@ void* Gamestate_Load(struct Game* game, void (*progress)(struct Game*)) {
 			char filename[255];
 			snprintf(filename, 255, "mask/mask-%d-%d.png", i, j);
 
-			data->pola[i][j].bmp = al_load_bitmap(GetDataFilePath(game, filename));
+			data->pola[i][j].bmp = LoadMaskBitmap(game, filename);
 			progress(game);
 
 			snprintf(filename, 255, "mask/mask-%d-%d.ini", i, j);
@@ -553,27 +1283,17 @@ void* Gamestate_Load(struct Game* game, void (*progress)(struct Game*)) {
 			progress(game);
 		}
 	}
-	data->duzepole = al_load_bitmap(GetDataFilePath(game, "mask/mask-duze.png"));
+	data->duzepole = LoadMaskBitmap(game, "mask/mask-duze.png");
 
-	data->disco[0] = al_load_bitmap(GetDataFilePath(game, "01disko00.png"));
-	progress(game);
-	data->disco[1] = al_load_bitmap(GetDataFilePath(game, "01disko01.png"));
-	progress(game);
-	data->disco[2] = al_load_bitmap(GetDataFilePath(game, "01disko02.png"));
-	progress(game);
-	data->disco[3] = al_load_bitmap(GetDataFilePath(game, "01disko03.png"));
-	progress(game);
-	data->disco[4] = al_load_bitmap(GetDataFilePath(game, "01disko04.png"));
-	progress(game);
-	data->disco[5] = al_load_bitmap(GetDataFilePath(game, "01disko05.png"));
+	data->ball = LoadPrewarmedBitmap(game, "01disko01.png");
 	progress(game);
 
-	data->nozka1 = al_load_bitmap(GetDataFilePath(game, "nozka01.png"));
-	data->nozka2 = al_load_bitmap(GetDataFilePath(game, "nozka02.png"));
-	data->nozka3 = al_load_bitmap(GetDataFilePath(game, "nozka03.png"));
-	data->nozka4 = al_load_bitmap(GetDataFilePath(game, "nozka04.png"));
-	data->shadow = al_load_bitmap(GetDataFilePath(game, "cien.png"));
-	data->chleb = al_load_bitmap(GetDataFilePath(game, "chleb.png"));
+	data->nozka1 = LoadPrewarmedBitmap(game, "nozka01.png");
+	data->nozka2 = LoadPrewarmedBitmap(game, "nozka02.png");
+	data->nozka3 = LoadPrewarmedBitmap(game, "nozka03.png");
+	data->nozka4 = LoadPrewarmedBitmap(game, "nozka04.png");
+	data->shadow = LoadMaskBitmap(game, "cien.png");
+	data->chleb = LoadPrewarmedBitmap(game, "chleb.png");
 	progress(game);
 
 	data->music = al_load_audio_stream(GetDataFilePath(game, "startrek.flac"), 4, 1024);
@@ -581,23 +1301,40 @@ void* Gamestate_Load(struct Game* game, void (*progress)(struct Game*)) {
 	al_set_audio_stream_gain(data->music, 0.85);
 	al_attach_audio_stream_to_mixer(data->music, game->audio.music);
 	al_set_audio_stream_playmode(data->music, ALLEGRO_PLAYMODE_ONCE);
+	// stream position is reported for data already queued for playback
+	data->latency = al_get_audio_stream_fragments(data->music) * al_get_audio_stream_length(data->music) / (double)al_get_audio_stream_frequency(data->music);
+	data->latency += atof(GetConfigOptionDefault(game, "SpiderDisco", "audio_latency", "0")) / 1000.0;
+	LoadBeatGrid(game, data, "startrek.ini");
 	progress(game);
 
+	data->lag.enabled = strtol(GetConfigOptionDefault(game, "SpiderDisco", "latency_test", "0"), NULL, 10);
+
 	for (int i = 0; i < NUMBER_OF_PAJONKS; i++) {
 		data->pajonczki[i] = CreateCharacter(game, "pajonczek");
 		data->pajonczki[i]->shared = true;
 		data->pajonczki[i]->spritesheets = data->pajonczek->spritesheets;
-		data->pajonczki[i]->data = malloc(sizeof(struct PajonkData));
+		data->pajonczki[i]->data = ArenaAlloc(data->arena, sizeof(struct PajonkData));
 		progress(game);
 	}
 
 	progress(game); // report that we progressed with the loading, so the engine can draw a progress bar
+	EndTrace(game, "disco Load", trace);
 	return data;
 }
 
 void Gamestate_PostLoad(struct Game* game, struct GamestateResources* data) {
-	data->tmp = CreateNotPreservedBitmap(1920, 1080);
-	data->mask = CreateNotPreservedBitmap(1920, 1080);
+	double trace = BeginTrace(game);
+	SetResourceScope("disco");
+	data->tmp = CreateRenderTarget(game, 1920, 1080, 1.0);
+	data->mask = CreateRenderTarget(game, 1920, 1080, 1.0);
+	data->tmp_lowres = CreateRenderTarget(game, 1920, 1080, 0.5);
+	data->ball_shader = CreatePixelShader(game, BALL_PIXEL_SHADER);
+	if (data->ball_shader) {
+		// without the shader the ball stays still and has no use for it
+		data->facets = CreateFacetMap(game, "matryca.png");
+	}
+	SetResourceScope(NULL);
+	EndTrace(game, "disco PostLoad", trace);
 }
 
 void Gamestate_Unload(struct Game* game, struct GamestateResources* data) {
@@ -606,7 +1343,6 @@ void Gamestate_Unload(struct Game* game, struct GamestateResources* data) {
 	al_destroy_font(data->font);
 
 	for (int i = 0; i < NUMBER_OF_PAJONKS; i++) {
-		free(data->pajonczki[i]->data);
 		DestroyCharacter(game, data->pajonczki[i]);
 	}
 	DestroyCharacter(game, data->pajonczek);
@@ -633,15 +1369,15 @@ void Gamestate_Unload(struct Game* game, struct GamestateResources* data) {
 	al_destroy_bitmap(data->listek2);
 	al_destroy_bitmap(data->listek3);
 	al_destroy_bitmap(data->cien);
-	al_destroy_bitmap(data->matryca);
+	if (data->facets) {
+		al_destroy_bitmap(data->facets);
+	}
+	if (data->ball_shader) {
+		al_destroy_shader(data->ball_shader);
+	}
 	al_destroy_bitmap(data->duzepole);
 
-	al_destroy_bitmap(data->disco[0]);
-	al_destroy_bitmap(data->disco[1]);
-	al_destroy_bitmap(data->disco[2]);
-	al_destroy_bitmap(data->disco[3]);
-	al_destroy_bitmap(data->disco[4]);
-	al_destroy_bitmap(data->disco[5]);
+	al_destroy_bitmap(data->ball);
 
 	for (int i = 0; i < 20; i++) {
 		for (int j = 0; j < 6; j++) {
@@ -657,9 +1393,13 @@ void Gamestate_Unload(struct Game* game, struct GamestateResources* data) {
 
 	al_destroy_bitmap(data->mask);
 	al_destroy_bitmap(data->tmp);
+	al_destroy_bitmap(data->tmp_lowres);
 	al_destroy_bitmap(data->chleb);
+	al_destroy_mutex(data->sim.mutex);
 
-	free(data);
+	DestroyParticles(data->particles);
+	DestroyFrameCache(&data->frame);
+	DestroyArena(data->arena);
 }
 
 void Gamestate_Start(struct Game* game, struct GamestateResources* data) {
@@ -672,32 +1412,53 @@ void Gamestate_Start(struct Game* game, struct GamestateResources* data) {
 	SetCharacterPosition(game, data->dron, 775, 268, 0);
 
 	SelectSpritesheet(game, data->kula, "kula");
+	data->kula->scaleX = 0.75;
+	data->kula->scaleY = 0.75;
 
 	for (int i = 0; i < 17; i++) {
 		data->oops[i].used = false;
 	}
 
+	data->rng = BeginReplay(game, rand());
+
 	for (int i = 0; i < NUMBER_OF_PAJONKS; i++) {
 		SelectSpritesheet(game, data->pajonczki[i], "stand");
 		//SetCharacterPositionF(game, data->pajonczki[i], (rand() / (float)RAND_MAX) / 2.5 + 0.3 - 0.05, (rand() / (float)RAND_MAX) / 1.5 + 0.165, 0);
-		data->pajonczki[i]->pos = rand() % 3;
+		data->pajonczki[i]->pos = Random(&data->rng) % 3;
 		struct PajonkData* d = data->pajonczki[i]->data;
-		d->angle = (rand() / (float)RAND_MAX) * 2 * ALLEGRO_PI;
+		d->angle = (Random(&data->rng) / (float)RANDOM_MAX) * 2 * ALLEGRO_PI;
 		d->angle_mod = 0;
-		d->right = rand() % 2;
-		d->r = rand() % 225 + 125;
+		d->right = Random(&data->rng) % 2;
+		d->r = Random(&data->rng) % 225 + 125;
 		d->dead = false;
-		d->angle_range = (rand() / (float)RAND_MAX) * 0.33 + 0.1;
-		d->speed = (rand() / (float)RAND_MAX) * 0.005 + 0.005;
-		d->sin = (rand() / (float)RAND_MAX);
-		data->pajonczki[i]->delta = (rand() / (float)RAND_MAX) * data->pajonczki[i]->frame->duration;
+		d->angle_range = (Random(&data->rng) / (float)RANDOM_MAX) * 0.33 + 0.1;
+		d->speed = (Random(&data->rng) / (float)RANDOM_MAX) * 0.005 + 0.005;
+		d->sin = (Random(&data->rng) / (float)RANDOM_MAX);
+		data->pajonczki[i]->delta = (Random(&data->rng) / (float)RANDOM_MAX) * data->pajonczki[i]->frame->duration;
 	}
 
 	data->wind = 0;
 	al_set_audio_stream_playing(data->music, true);
-	data->discocount = 0.5;
+	data->lights.mode = 0;
+	data->lights.changed = 0;
 	data->pole = 0;
 	data->nozka = 1;
+	data->clock = 0;
+	data->beat = 0;
+	data->step = 0;
+	data->sim_time = GetClock(game);
+	data->turns.count = 0;
+	data->moved.x = NULL;
+	data->prewarmed = false;
+
+	InitGovernor(game, &data->quality, QUALITY_LEVELS, GetConfigOptionDefault(game, "SpiderDisco", "quality", "auto"));
+
+	data->lag.stage = LAG_IDLE;
+	ResetHistogram(&data->lag.queue_hist);
+	ResetHistogram(&data->lag.tick_hist);
+	ResetHistogram(&data->lag.draw_hist);
+	ResetHistogram(&data->lag.flip_hist);
+	ResetHistogram(&data->lag.total_hist);
 
 	data->noga1 = 0;
 	data->noga2 = 0;
@@ -715,20 +1476,60 @@ void Gamestate_Start(struct Game* game, struct GamestateResources* data) {
 	data->noga2y = 0;
 	data->noga3y = 0;
 	data->noga4y = 0;
+
+	data->skip = false;
+	data->ended = false;
+	data->sim_beat = 0;
+	data->sim.beat = 0;
+	data->sim.input_count = 0;
+	data->sim.paused = false;
+	data->burst_count = 0;
+	data->bursts_seen = 0;
+	ClearParticles(data->particles);
+	InvalidateFrameCache(&data->frame);
+	PositionCharacters(game, data);
+	Publish(game, data);
+	if (!game->data->export.enabled) {
+		data->sim.thread = al_create_thread(Simulation, data);
+		al_start_thread(data->sim.thread);
+	}
 }
 
 void Gamestate_Stop(struct Game* game, struct GamestateResources* data) {
 	// Called when gamestate gets stopped. Stop timers, music etc. here.
+	if (data->sim.thread) {
+		al_destroy_thread(data->sim.thread); // waits for the current tick to finish
+		data->sim.thread = NULL;
+	}
 	al_set_audio_stream_playing(data->music, false);
+	FinishReplay(game);
+
+	if (data->lag.enabled) {
+		PrintHistogram(game, &data->lag.queue_hist, "latency: event queue");
+		PrintHistogram(game, &data->lag.tick_hist, "latency: event to tick");
+		PrintHistogram(game, &data->lag.draw_hist, "latency: tick to draw");
+		PrintHistogram(game, &data->lag.flip_hist, "latency: draw to flip");
+		PrintHistogram(game, &data->lag.total_hist, "latency: total");
+	}
 }
 
 void Gamestate_Pause(struct Game* game, struct GamestateResources* data) {
 	// Called when gamestate gets paused (so only Draw is being called, no Logic not ProcessEvent)
 	// Pause your timers here.
+	al_set_audio_stream_playing(data->music, false);
+	game->data->paused = true;
+	al_lock_mutex(data->sim.mutex);
+	data->sim.paused = true;
+	al_unlock_mutex(data->sim.mutex);
 }
 
 void Gamestate_Resume(struct Game* game, struct GamestateResources* data) {
 	// Called when gamestate gets resumed. Resume your timers here.
+	al_set_audio_stream_playing(data->music, true);
+	game->data->paused = false;
+	al_lock_mutex(data->sim.mutex);
+	data->sim.paused = false;
+	al_unlock_mutex(data->sim.mutex);
 }
 
 // Ignore this for now.
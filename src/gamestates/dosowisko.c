@@ -36,6 +36,8 @@ struct GamestateResources {
 	char text[255];
 	bool underscore, fadeout;
 	struct Timeline* timeline;
+
+	struct Arena* arena;
 };
 
 int Gamestate_ProgressCount = 5;
@@ -68,6 +70,7 @@ static TM_ACTION(FadeOut) {
 
 static TM_ACTION(End) {
 	TM_RunningOnly;
+	TraceInstant(game, "switch to " NEXT_GAMESTATE);
 	SwitchCurrentGamestate(game, NEXT_GAMESTATE);
 	return true;
 }
@@ -92,11 +95,20 @@ static TM_ACTION(Type) {
 //==================================Timeline manager actions END
 
 void Gamestate_Logic(struct Game* game, struct GamestateResources* data, double delta) {
+	if (SkipEngineStep(game)) {
+		return; // run by StepExport instead
+	}
+	double trace = BeginTrace(game);
+	double tm = BeginTrace(game);
 	TM_Process(data->timeline, delta);
+	EndTrace(game, "TM_Process", tm);
 	data->underscore = Fract(game->time) >= 0.5;
+	EndTrace(game, "dosowisko Logic", trace);
 }
 
 void Gamestate_Draw(struct Game* game, struct GamestateResources* data) {
+	double trace = BeginTrace(game);
+	SetFramebufferAsTarget(game);
 	if (!data->fadeout) {
 		char t[255] = "";
 		strncpy(t, data->text, 255);
@@ -133,6 +145,7 @@ void Gamestate_Draw(struct Game* game, struct GamestateResources* data) {
 
 		al_draw_scaled_bitmap(data->pixelator, 0, 0, 320, 180, 0, 0, game->viewport.width, game->viewport.height, 0);
 	}
+	EndTrace(game, "dosowisko Draw", trace);
 }
 
 void Gamestate_Start(struct Game* game, struct GamestateResources* data) {
@@ -164,7 +177,11 @@ void Gamestate_ProcessEvent(struct Game* game, struct GamestateResources* data,
 }
 
 void* Gamestate_Load(struct Game* game, void (*progress)(struct Game*)) {
-	struct GamestateResources* data = malloc(sizeof(struct GamestateResources));
+	double trace = BeginTrace(game);
+	struct Arena* arena = CreateArena(game, "dosowisko");
+	struct GamestateResources* data = ArenaAlloc(arena, sizeof(struct GamestateResources));
+	data->arena = arena;
+	SetAssetScope(game, "dosowisko");
 	int flags = al_get_new_bitmap_flags();
 	al_set_new_bitmap_flags(flags & ~ALLEGRO_MAG_LINEAR);
 
@@ -198,10 +215,12 @@ void* Gamestate_Load(struct Game* game, void (*progress)(struct Game*)) {
 
 	al_set_new_bitmap_flags(flags);
 
+	EndTrace(game, "dosowisko Load", trace);
 	return data;
 }
 
 void Gamestate_PostLoad(struct Game* game, struct GamestateResources* data) {
+	SetResourceScope("dosowisko");
 	al_set_target_bitmap(data->checkerboard);
 	al_lock_bitmap(data->checkerboard, ALLEGRO_PIXEL_FORMAT_ANY, ALLEGRO_LOCK_WRITEONLY);
 	int x, y;
@@ -214,6 +233,7 @@ void Gamestate_PostLoad(struct Game* game, struct GamestateResources* data) {
 		}
 	}
 	al_unlock_bitmap(data->checkerboard);
+	SetResourceScope(NULL);
 }
 
 void Gamestate_Stop(struct Game* game, struct GamestateResources* data) {
@@ -234,7 +254,7 @@ void Gamestate_Unload(struct Game* game, struct GamestateResources* data) {
 	al_destroy_bitmap(data->checkerboard);
 	al_destroy_bitmap(data->pixelator);
 	TM_Destroy(data->timeline);
-	free(data);
+	DestroyArena(data->arena);
 }
 
 void Gamestate_Reload(struct Game* game, struct GamestateResources* data) {
@@ -29,24 +29,35 @@ struct GamestateResources {
 	ALLEGRO_BITMAP* bmp;
 	double counter;
 	ALLEGRO_AUDIO_STREAM* monkeys;
+
+	struct Arena* arena;
 };
 
 int Gamestate_ProgressCount = 1;
 
 void Gamestate_Logic(struct Game* game, struct GamestateResources* data, double delta) {
+	if (SkipEngineStep(game)) {
+		return; // run by StepExport instead
+	}
+	double trace = BeginTrace(game);
 	data->counter += delta * 60;
 	if (data->counter > 60 * 5.2) {
+		TraceInstant(game, "switch to " NEXT_GAMESTATE);
 		SwitchCurrentGamestate(game, NEXT_GAMESTATE);
 	}
+	EndTrace(game, "holypangolin Logic", trace);
 }
 
 void Gamestate_Draw(struct Game* game, struct GamestateResources* data) {
+	double trace = BeginTrace(game);
+	SetFramebufferAsTarget(game);
 	al_clear_to_color(al_map_rgb(255, 255, 255));
 	al_draw_scaled_bitmap(data->bmp, 0, 0, al_get_bitmap_width(data->bmp), al_get_bitmap_height(data->bmp), 0, 0, game->viewport.width, game->viewport.height, 0);
 
 	if (data->counter < 320) {
 		al_draw_filled_rectangle(0, 0, game->viewport.width, game->viewport.height, al_map_rgba_f(1 - data->counter / 280.0, 1 - data->counter / 280.0, 1 - data->counter / 280.0, 1 - data->counter / 280.0));
 	}
+	EndTrace(game, "holypangolin Draw", trace);
 }
 
 void Gamestate_ProcessEvent(struct Game* game, struct GamestateResources* data, ALLEGRO_EVENT* ev) {
@@ -57,7 +68,11 @@ void Gamestate_ProcessEvent(struct Game* game, struct GamestateResources* data,
 }
 
 void* Gamestate_Load(struct Game* game, void (*progress)(struct Game*)) {
-	struct GamestateResources* data = malloc(sizeof(struct GamestateResources));
+	double trace = BeginTrace(game);
+	struct Arena* arena = CreateArena(game, "holypangolin");
+	struct GamestateResources* data = ArenaAlloc(arena, sizeof(struct GamestateResources));
+	data->arena = arena;
+	SetAssetScope(game, "holypangolin");
 	data->bmp = al_load_bitmap(GetDataFilePath(game, "holypangolin.webp"));
 	progress(game); // report that we progressed with the loading, so the engine can draw a progress bar
 
@@ -66,13 +81,14 @@ void* Gamestate_Load(struct Game* game, void (*progress)(struct Game*)) {
 	al_attach_audio_stream_to_mixer(data->monkeys, game->audio.fx);
 	al_set_audio_stream_gain(data->monkeys, 0.75);
 
+	EndTrace(game, "holypangolin Load", trace);
 	return data;
 }
 
 void Gamestate_Unload(struct Game* game, struct GamestateResources* data) {
 	al_destroy_bitmap(data->bmp);
 	al_destroy_audio_stream(data->monkeys);
-	free(data);
+	DestroyArena(data->arena);
 }
 
 void Gamestate_Start(struct Game* game, struct GamestateResources* data) {
@@ -35,31 +35,50 @@ struct GamestateResources {
 
 	bool skip;
 	char* text;
+	struct FrameCache frame;
+
+	struct Arena* arena;
 };
 
 int Gamestate_ProgressCount = 11; // number of loading steps as reported by Gamestate_Load
 
 void Gamestate_Logic(struct Game* game, struct GamestateResources* data, double delta) {
 	// Called 60 times per second. Here you should do all your game logic.
+	if (SkipEngineStep(game)) {
+		return; // run by StepExport instead
+	}
+	double trace = BeginTrace(game);
+	double tm = BeginTrace(game);
 	TM_Process(data->timeline, delta);
+	EndTrace(game, "TM_Process", tm);
+	EndTrace(game, "intro Logic", trace);
 }
 
 void Gamestate_Draw(struct Game* game, struct GamestateResources* data) {
 	// Called as soon as possible, but no sooner than next Gamestate_Logic call.
 	// Draw everything to the screen here.
-	al_clear_to_color(al_map_rgb(255, 255, 255));
-	if (data->bitmap) {
-		//	al_draw_scaled_bitmap(data->bitmap, 0, 0, al_get_bitmap_width(data->bitmap),
-		//	                      al_get_bitmap_height(data->bitmap), 0, 0, 1920, 1080, 0);
-
-		al_draw_bitmap(data->bitmap, -240, -160, 0);
-	}
-
-	if (data->text) {
-		al_draw_text(data->font, al_map_rgb(0, 0, 0), 1920 / 2, 1000, ALLEGRO_ALIGN_CENTER, data->text);
+	double trace = BeginTrace(game);
+	SetFramebufferAsTarget(game);
+	BeginOverdraw(game);
+	// the picture and the subtitle only change between lines of the narration
+	if (BeginCachedFrame(game, &data->frame, (uintptr_t)data->bitmap * 31 + (uintptr_t)data->text)) {
+		al_clear_to_color(al_map_rgb(255, 255, 255));
+		if (data->bitmap) {
+			//	al_draw_scaled_bitmap(data->bitmap, 0, 0, al_get_bitmap_width(data->bitmap),
+			//	                      al_get_bitmap_height(data->bitmap), 0, 0, 1920, 1080, 0);
+
+			DrawLayer(game, "intro", data->bitmap, -240, -160);
+		}
+
+		if (data->text) {
+			al_draw_text(data->font, al_map_rgb(0, 0, 0), 1920 / 2, 1000, ALLEGRO_ALIGN_CENTER, data->text);
+		}
 	}
+	FinishCachedFrame(game, &data->frame);
+	FinishOverdraw(game);
 
 	//TM_DrawDebug(game, data->timeline, 0);
+	EndTrace(game, "intro Draw", trace);
 }
 
 void Gamestate_ProcessEvent(struct Game* game, struct GamestateResources* data, ALLEGRO_EVENT* ev) {
@@ -67,6 +86,7 @@ void Gamestate_ProcessEvent(struct Game* game, struct GamestateResources* data,
 	// Here you can handle user input, expiring timers etc.
 	if (((ev->type == ALLEGRO_EVENT_KEY_DOWN) && ((ev->keyboard.keycode == ALLEGRO_KEY_ESCAPE) || (ev->keyboard.keycode == ALLEGRO_KEY_BACK))) ||
 		(ev->type == ALLEGRO_EVENT_JOYSTICK_BUTTON_DOWN)) {
+		TraceInstant(game, "switch to tutorial");
 		SwitchCurrentGamestate(game, "tutorial");
 		LoadGamestate(game, "disco");
 		// When there are no active gamestates, the engine will quit.
@@ -78,6 +98,7 @@ void Gamestate_ProcessEvent(struct Game* game, struct GamestateResources* data,
 
 static TM_ACTION(Finish) {
 	if (action->state == TM_ACTIONSTATE_RUNNING) {
+		TraceInstant(game, "switch to tutorial");
 		SwitchCurrentGamestate(game, "tutorial");
 		LoadGamestate(game, "disco");
 	}
@@ -122,7 +143,13 @@ static TM_ACTION(Speak) {
 void* Gamestate_Load(struct Game* game, void (*progress)(struct Game*)) {
 	// Called once, when the gamestate library is being loaded.
 	// Good place for allocating memory, loading bitmaps etc.
-	struct GamestateResources* data = malloc(sizeof(struct GamestateResources));
+	double trace = BeginTrace(game);
+	struct Arena* arena = CreateArena(game, "intro");
+	struct GamestateResources* data = ArenaAlloc(arena, sizeof(struct GamestateResources));
+	data->arena = arena;
+	SetAssetScope(game, "intro");
+	ExpectLoadingAssets(game, "intro");
+	data->frame = (struct FrameCache){0};
 	data->timeline = TM_Init(game, data, "intro");
 
 	data->music = al_load_audio_stream(GetDataFilePath(game, "intro/music.flac"), 4, 1024);
@@ -136,59 +163,60 @@ void* Gamestate_Load(struct Game* game, void (*progress)(struct Game*)) {
 
 	TM_AddDelay(data->timeline, 0.6);
 
-	TM_AddAction(data->timeline, Show, TM_AddToArgs(NULL, 1, al_load_bitmap(GetDataFilePath(game, "intro/1.png"))));
+	TM_AddAction(data->timeline, Show, TM_AddToArgs(NULL, 1, ArenaBitmap(data->arena, LoadPrewarmedBitmap(game, "intro/1.png"))));
 	TM_AddDelay(data->timeline, 0.4);
 	TM_AddAction(data->timeline, Speak, TM_AddToArgs(NULL, 2, al_load_audio_stream(GetDataFilePath(game, "intro/1.flac"), 4, 1024), "Once upon a time there was a little drone named Bobby."));
 	TM_AddAction(data->timeline, Speak, TM_AddToArgs(NULL, 2, al_load_audio_stream(GetDataFilePath(game, "intro/1a.flac"), 4, 1024), "Bobby had a human owner, who was a reckless boy."));
 	progress(game);
 
-	TM_AddAction(data->timeline, Show, TM_AddToArgs(NULL, 1, al_load_bitmap(GetDataFilePath(game, "intro/2.png"))));
+	TM_AddAction(data->timeline, Show, TM_AddToArgs(NULL, 1, ArenaBitmap(data->arena, LoadPrewarmedBitmap(game, "intro/2.png"))));
 	TM_AddAction(data->timeline, Speak, TM_AddToArgs(NULL, 2, al_load_audio_stream(GetDataFilePath(game, "intro/2.flac"), 4, 1024), "One day he crashed Bobby into the trees and ran away."));
 	progress(game);
 
-	TM_AddAction(data->timeline, Show, TM_AddToArgs(NULL, 1, al_load_bitmap(GetDataFilePath(game, "intro/3.png"))));
+	TM_AddAction(data->timeline, Show, TM_AddToArgs(NULL, 1, ArenaBitmap(data->arena, LoadPrewarmedBitmap(game, "intro/3.png"))));
 	TM_AddAction(data->timeline, Speak, TM_AddToArgs(NULL, 2, al_load_audio_stream(GetDataFilePath(game, "intro/3.flac"), 4, 1024), "Fortunately, the drone was rescued by a huge family of overprotective spiders."));
 	progress(game);
 
-	TM_AddAction(data->timeline, Show, TM_AddToArgs(NULL, 1, al_load_bitmap(GetDataFilePath(game, "intro/4.png"))));
+	TM_AddAction(data->timeline, Show, TM_AddToArgs(NULL, 1, ArenaBitmap(data->arena, LoadPrewarmedBitmap(game, "intro/4.png"))));
 	TM_AddAction(data->timeline, Speak, TM_AddToArgs(NULL, 2, al_load_audio_stream(GetDataFilePath(game, "intro/4.flac"), 4, 1024), "They lived happily for some time."));
 	progress(game);
 
-	TM_AddAction(data->timeline, Show, TM_AddToArgs(NULL, 1, al_load_bitmap(GetDataFilePath(game, "intro/5.png"))));
+	TM_AddAction(data->timeline, Show, TM_AddToArgs(NULL, 1, ArenaBitmap(data->arena, LoadPrewarmedBitmap(game, "intro/5.png"))));
 	TM_AddAction(data->timeline, Speak, TM_AddToArgs(NULL, 2, al_load_audio_stream(GetDataFilePath(game, "intro/5.flac"), 4, 1024), "He grew up with them, learned their ways: playing typical spider sports"));
 	progress(game);
 
-	TM_AddAction(data->timeline, Show, TM_AddToArgs(NULL, 1, al_load_bitmap(GetDataFilePath(game, "intro/6.png"))));
+	TM_AddAction(data->timeline, Show, TM_AddToArgs(NULL, 1, ArenaBitmap(data->arena, LoadPrewarmedBitmap(game, "intro/6.png"))));
 	TM_AddAction(data->timeline, Speak, TM_AddToArgs(NULL, 2, al_load_audio_stream(GetDataFilePath(game, "intro/6.flac"), 4, 1024), "and traditional spider dinner parties."));
 	TM_AddAction(data->timeline, Speak, TM_AddToArgs(NULL, 2, al_load_audio_stream(GetDataFilePath(game, "intro/6a.flac"), 4, 1024), "They accepted him."));
 	progress(game);
 
-	TM_AddAction(data->timeline, Show, TM_AddToArgs(NULL, 1, al_load_bitmap(GetDataFilePath(game, "intro/7.png"))));
+	TM_AddAction(data->timeline, Show, TM_AddToArgs(NULL, 1, ArenaBitmap(data->arena, LoadPrewarmedBitmap(game, "intro/7.png"))));
 	TM_AddAction(data->timeline, Speak, TM_AddToArgs(NULL, 2, al_load_audio_stream(GetDataFilePath(game, "intro/7.flac"), 4, 1024), "But he still felt quite out of place."));
 	TM_AddAction(data->timeline, Speak, TM_AddToArgs(NULL, 2, al_load_audio_stream(GetDataFilePath(game, "intro/7a.flac"), 4, 1024), "Perhaps due to the fact that he constantly kept squishing his new family,"));
 	progress(game);
 
-	TM_AddAction(data->timeline, Show, TM_AddToArgs(NULL, 1, al_load_bitmap(GetDataFilePath(game, "intro/8.png"))));
+	TM_AddAction(data->timeline, Show, TM_AddToArgs(NULL, 1, ArenaBitmap(data->arena, LoadPrewarmedBitmap(game, "intro/8.png"))));
 	TM_AddAction(data->timeline, Speak, TM_AddToArgs(NULL, 2, al_load_audio_stream(GetDataFilePath(game, "intro/8.flac"), 4, 1024), "Perhaps due to the fact that he constantly kept squishing his new family,"));
 	progress(game);
 
-	TM_AddAction(data->timeline, Show, TM_AddToArgs(NULL, 1, al_load_bitmap(GetDataFilePath(game, "intro/9.png"))));
+	TM_AddAction(data->timeline, Show, TM_AddToArgs(NULL, 1, ArenaBitmap(data->arena, LoadPrewarmedBitmap(game, "intro/9.png"))));
 	TM_AddAction(data->timeline, Speak, TM_AddToArgs(NULL, 2, al_load_audio_stream(GetDataFilePath(game, "intro/9.flac"), 4, 1024), "which led him to a personality crisis."));
 	TM_AddAction(data->timeline, Speak, TM_AddToArgs(NULL, 2, al_load_audio_stream(GetDataFilePath(game, "intro/9a.flac"), 4, 1024), "Spiders might be very forgiving, but he's a very emotional fella."));
 	progress(game);
 
-	TM_AddAction(data->timeline, Show, TM_AddToArgs(NULL, 1, al_load_bitmap(GetDataFilePath(game, "intro/10.png"))));
+	TM_AddAction(data->timeline, Show, TM_AddToArgs(NULL, 1, ArenaBitmap(data->arena, LoadPrewarmedBitmap(game, "intro/10.png"))));
 	TM_AddAction(data->timeline, Speak, TM_AddToArgs(NULL, 2, al_load_audio_stream(GetDataFilePath(game, "intro/10.flac"), 4, 1024), "Now Bobby wants to learn how to move like a spider."));
 	TM_AddAction(data->timeline, Speak, TM_AddToArgs(NULL, 2, al_load_audio_stream(GetDataFilePath(game, "intro/10a.flac"), 4, 1024), "So he gathered his friends and went to the..."));
 	progress(game);
 
-	TM_AddAction(data->timeline, Show, TM_AddToArgs(NULL, 1, al_load_bitmap(GetDataFilePath(game, "intro/11.png"))));
+	TM_AddAction(data->timeline, Show, TM_AddToArgs(NULL, 1, ArenaBitmap(data->arena, LoadPrewarmedBitmap(game, "intro/11.png"))));
 	TM_AddAction(data->timeline, Speak, TM_AddToArgs(NULL, 2, al_load_audio_stream(GetDataFilePath(game, "intro/11.flac"), 4, 1024), NULL));
 
 	TM_AddDelay(data->timeline, 1.0);
 
 	TM_AddAction(data->timeline, Finish, NULL);
 
+	EndTrace(game, "intro Load", trace);
 	return data;
 }
 
@@ -197,9 +225,9 @@ void Gamestate_Unload(struct Game* game, struct GamestateResources* data) {
 	// Good place for freeing all allocated memory and resources.
 	al_destroy_audio_stream(data->music);
 	TM_Destroy(data->timeline);
-	al_destroy_bitmap(data->bitmap);
 	al_destroy_font(data->font);
-	free(data);
+	DestroyFrameCache(&data->frame);
+	DestroyArena(data->arena);
 }
 
 void Gamestate_Start(struct Game* game, struct GamestateResources* data) {
@@ -208,6 +236,7 @@ void Gamestate_Start(struct Game* game, struct GamestateResources* data) {
 	data->bitmap = NULL;
 	data->skip = false;
 	data->text = NULL;
+	InvalidateFrameCache(&data->frame);
 	al_set_audio_stream_playing(data->music, true);
 }
 
@@ -219,10 +248,14 @@ void Gamestate_Stop(struct Game* game, struct GamestateResources* data) {
 void Gamestate_Pause(struct Game* game, struct GamestateResources* data) {
 	// Called when gamestate gets paused (so only Draw is being called, no Logic not ProcessEvent)
 	// Pause your timers here.
+	al_set_audio_stream_playing(data->music, false);
+	game->data->paused = true;
 }
 
 void Gamestate_Resume(struct Game* game, struct GamestateResources* data) {
 	// Called when gamestate gets resumed. Resume your timers here.
+	al_set_audio_stream_playing(data->music, true);
+	game->data->paused = false;
 }
 
 // Ignore this for now.
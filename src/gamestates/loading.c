@@ -21,11 +21,18 @@
 
 #include "../common.h"
 #include <libsuperderpy.h>
+#include <math.h>
 
 /*! \brief Resources used by Loading state. */
 struct GamestateResources {
 	ALLEGRO_BITMAP* loading_bitmap; /*!< Rendered loading bitmap. */
 	struct Character* pajonczek;
+	struct FrameCache frame; /*!< Last rendered frame, reused between render ticks. */
+	double last_render; /*!< Wall clock time of the last render tick. */
+	double frame_time; /*!< Minimal time between render ticks. */
+	double shown; /*!< Progress shown by the bar. */
+	int renders;
+	struct Arena* arena; /*!< Everything allocated in Gamestate_Load. */
 };
 
 int Gamestate_ProgressCount = -1;
@@ -34,24 +41,57 @@ void Gamestate_ProcessEvent(struct Game* game, struct GamestateResources* data,
 
 void Gamestate_Logic(struct Game* game, struct GamestateResources* data, double delta){};
 
-void Gamestate_Draw(struct Game* game, struct GamestateResources* data) {
-	double p = game->loading.progress;
+static void Render(struct Game* game, struct GamestateResources* data, double delta) {
+	double target = GetLoadingProgress(game);
+	if (target < data->shown) {
+		data->shown = target; // a new batch of gamestates started loading
+	}
+	data->shown += (target - data->shown) * fmin(delta * 10.0, 1.0);
+
 	if (!game->data->darkloading) {
 		al_clear_to_color(al_map_rgb(255, 255, 255));
 		al_draw_bitmap(data->loading_bitmap, game->viewport.width * 0.075, game->viewport.height * 0.92, 0);
-		AnimateCharacter(game, data->pajonczek, 1.0 / 60.0, 1.5);
+		AnimateCharacter(game, data->pajonczek, delta, 1.5);
 		DrawCharacter(game, data->pajonczek);
 		al_draw_filled_rectangle(0, game->viewport.height * 0.99, game->viewport.width,
 			game->viewport.height, al_map_rgba(0, 0, 0, 32));
-		al_draw_filled_rectangle(0, game->viewport.height * 0.99, p * game->viewport.width,
+		al_draw_filled_rectangle(0, game->viewport.height * 0.99, data->shown * game->viewport.width,
 			game->viewport.height, al_map_rgba(0, 0, 0, 255));
 	} else {
 		al_clear_to_color(al_map_rgb(0, 0, 0));
 	}
 }
 
+void Gamestate_Draw(struct Game* game, struct GamestateResources* data) {
+	// This gets called for every loading step reported, so the screen is only
+	// rendered again once per display refresh and animated by the wall clock.
+	double trace = BeginTrace(game);
+	SetFramebufferAsTarget(game);
+	double now = al_get_time();
+	double delta = now - data->last_render;
+	if (delta >= data->frame_time) {
+		data->renders++;
+	}
+	if (BeginCachedFrame(game, &data->frame, data->renders)) {
+		Render(game, data, fmin(delta, 0.1));
+		data->last_render = now;
+	}
+	FinishCachedFrame(game, &data->frame);
+	EndTrace(game, "loading Draw", trace);
+}
+
 void* Gamestate_Load(struct Game* game, void (*progress)(struct Game*)) {
-	struct GamestateResources* data = malloc(sizeof(struct GamestateResources));
+	double trace = BeginTrace(game);
+	struct Arena* arena = CreateArena(game, "loading");
+	struct GamestateResources* data = ArenaAlloc(arena, sizeof(struct GamestateResources));
+	data->arena = arena;
+	SetAssetScope(game, "loading");
+	data->frame = (struct FrameCache){0};
+	data->last_render = al_get_time();
+	data->shown = 0;
+	data->renders = 0;
+	int refresh = al_get_display_refresh_rate(game->display);
+	data->frame_time = 1.0 / (refresh > 0 ? refresh : 60);
 	int flags = al_get_new_bitmap_flags();
 	al_add_new_bitmap_flag(ALLEGRO_MAG_LINEAR | ALLEGRO_MIN_LINEAR);
 	al_clear_to_color(al_map_rgb(255, 255, 255));
@@ -69,14 +109,23 @@ void* Gamestate_Load(struct Game* game, void (*progress)(struct Game*)) {
 	SetCharacterPositionF(game, data->pajonczek, 0.02, 0.9, 0);
 	al_set_new_bitmap_flags(flags);
 
+	EndTrace(game, "loading Load", trace);
 	return data;
 }
 
 void Gamestate_Unload(struct Game* game, struct GamestateResources* data) {
 	al_destroy_bitmap(data->loading_bitmap);
 	DestroyCharacter(game, data->pajonczek);
-	free(data);
+	DestroyFrameCache(&data->frame);
+	DestroyArena(data->arena);
 }
 
-void Gamestate_Start(struct Game* game, struct GamestateResources* data) {}
-void Gamestate_Stop(struct Game* game, struct GamestateResources* data) {}
+void Gamestate_Start(struct Game* game, struct GamestateResources* data) {
+	data->shown = 0;
+	data->last_render = al_get_time();
+	InvalidateFrameCache(&data->frame);
+}
+
+void Gamestate_Stop(struct Game* game, struct GamestateResources* data) {
+	FinishLoadingProgress(game);
+}
@@ -80,6 +80,9 @@ struct GamestateResources {
 	float counter;
 
 	ALLEGRO_BITMAP *bmp, *tmp;
+	int height;
+	struct FrameCache menu;
+	bool resume_music;
 
 	ALLEGRO_BITMAP *bg, *bg2;
 	ALLEGRO_AUDIO_STREAM* music;
@@ -102,6 +105,8 @@ struct GamestateResources {
 	struct Timeline* credits;
 	int creditnr;
 	bool skipping;
+
+	struct Arena* arena;
 };
 
 int Gamestate_ProgressCount = 1; // number of loading steps as reported by Gamestate_Load
@@ -117,6 +122,10 @@ void Gamestate_Logic(struct Game* game, struct GamestateResources* data, double
 
 void Gamestate_Tick(struct Game* game, struct GamestateResources* data) {
 	// Called 60 times per second. Here you should do all your game logic.
+	if (SkipEngineStep(game)) {
+		return; // run by StepExport instead
+	}
+	double trace = BeginTrace(game);
 	double delta = 1.0 / 60.0;
 	if (data->blink_counter < 120) {
 		data->blink_counter++;
@@ -141,7 +150,9 @@ void Gamestate_Tick(struct Game* game, struct GamestateResources* data) {
 		if (data->fade > 0) {
 			data->fade -= 0.0033;
 		} else {
+			double tm = BeginTrace(game);
 			TM_Process(data->credits, delta);
+			EndTrace(game, "TM_Process", tm);
 		}
 	}
 
@@ -152,18 +163,49 @@ void Gamestate_Tick(struct Game* game, struct GamestateResources* data) {
 			al_set_audio_stream_gain(data->music, gain);
 		}
 	}
+	EndTrace(game, "outro Tick", trace);
+}
+
+static void DrawMenu(struct Game* game, struct GamestateResources* data) {
+	// The background is faded out by now, so only the highlight can change.
+	int highlight = (1 - fabs(sin(data->counter * 64.0))) * 64 + 100;
+	if (BeginCachedFrame(game, &data->menu, data->choice * 256 + highlight)) {
+		al_clear_to_color(al_map_rgb(0, 0, 0));
+
+		ALLEGRO_COLOR color = al_map_rgb(255, 240, highlight);
+		ALLEGRO_COLOR white = al_map_rgb(255, 255, 255);
+		al_draw_text(data->font, (data->choice == 0) ? color : white, 1920 / 2.0, 1080 / 2.0 - 50, ALLEGRO_ALIGN_CENTER, "Play again");
+		al_draw_text(data->font, (data->choice == 0) ? white : color, 1920 / 2.0, 1080 / 2.0 + 50, ALLEGRO_ALIGN_CENTER, "Exit");
+
+		al_draw_text(data->font, al_map_rgb(255, 255, 255), 25, 1000, ALLEGRO_ALIGN_LEFT, "https://agatanawrot.com/");
+		al_draw_text(data->font, al_map_rgb(255, 255, 255), 1920 - 25, 1000, ALLEGRO_ALIGN_RIGHT, "https://dosowisko.net/");
+	}
+	FinishCachedFrame(game, &data->menu);
 }
 
 void Gamestate_Draw(struct Game* game, struct GamestateResources* data) {
 	// Called as soon as possible, but no sooner than next Gamestate_Logic call.
 	// Draw everything to the screen here.
+	double trace = BeginTrace(game);
+	SetFramebufferAsTarget(game);
+	if (data->creditnr >= 5) {
+		BeginOverdraw(game);
+		DrawMenu(game, data);
+		FinishOverdraw(game);
+		EndTrace(game, "outro Draw", trace);
+		return;
+	}
+
+	BeginOverdraw(game);
 	if (data->fade > 0.0) {
-		al_draw_bitmap(data->bg, -240 + sin(data->counter) * 200, -160, 0);
-		al_draw_bitmap(data->bg2, -240, -160, 0);
-		al_draw_bitmap(data->bmp, 1920 / 2 - 30, data->pos, 0);
+		DrawLayer(game, "bg", data->bg, -240 + sin(data->counter) * 200, -160);
+		DrawLayer(game, "bg2", data->bg2, -240, -160);
+		DrawRenderTarget(data->bmp, 1920 / 2 - 30, data->pos, 1920 / 2 + 200, data->height);
+		RecordOverdraw(game, "memorial", 1920 / 2 - 30, data->pos, 1920 / 2 + 200, data->height);
 	}
 
 	al_draw_filled_rectangle(0, 0, 1920, 1080, al_map_rgba_f(0, 0, 0, 1 - data->fade));
+	RecordOverdraw(game, "fade", 0, 0, 1920, 1080);
 
 	if (data->creditnr == 1) {
 		al_draw_text(data->font, al_map_rgb(255, 255, 255), 1920 / 2.0, 1080 / 2.0 - 30, ALLEGRO_ALIGN_CENTER, "Made by");
@@ -186,15 +228,8 @@ void Gamestate_Draw(struct Game* game, struct GamestateResources* data) {
 		al_draw_text(data->font, al_map_rgb(255, 255, 255), 1920 / 2.0, 1080 / 2.0 + 50, ALLEGRO_ALIGN_CENTER, "Licensed under Creative Commons: By Attribution 3.0");
 	}
 
-	if (data->creditnr >= 5) {
-		ALLEGRO_COLOR color = al_map_rgb(255, 240, (1 - fabs(sin(data->counter * 64.0))) * 64 + 100);
-		ALLEGRO_COLOR white = al_map_rgb(255, 255, 255);
-		al_draw_text(data->font, (data->choice == 0) ? color : white, 1920 / 2.0, 1080 / 2.0 - 50, ALLEGRO_ALIGN_CENTER, "Play again");
-		al_draw_text(data->font, (data->choice == 0) ? white : color, 1920 / 2.0, 1080 / 2.0 + 50, ALLEGRO_ALIGN_CENTER, "Exit");
-
-		al_draw_text(data->font, al_map_rgb(255, 255, 255), 25, 1000, ALLEGRO_ALIGN_LEFT, "https://agatanawrot.com/");
-		al_draw_text(data->font, al_map_rgb(255, 255, 255), 1920 - 25, 1000, ALLEGRO_ALIGN_RIGHT, "https://dosowisko.net/");
-	}
+	FinishOverdraw(game);
+	EndTrace(game, "outro Draw", trace);
 }
 
 void Gamestate_ProcessEvent(struct Game* game, struct GamestateResources* data, ALLEGRO_EVENT* ev) {
@@ -222,6 +257,7 @@ void Gamestate_ProcessEvent(struct Game* game, struct GamestateResources* data,
 		UnloadAllGamestates(game); // mark this gamestate to be stopped and unloaded
 		// When there are no active gamestates, the engine will quit.
 		if (data->choice == 0) {
+			TraceInstant(game, "switch to intro");
 			SwitchCurrentGamestate(game, "intro");
 		}
 	}
@@ -235,7 +271,13 @@ void Gamestate_ProcessEvent(struct Game* game, struct GamestateResources* data,
 void* Gamestate_Load(struct Game* game, void (*progress)(struct Game*)) {
 	// Called once, when the gamestate library is being loaded.
 	// Good place for allocating memory, loading bitmaps etc.
-	struct GamestateResources* data = malloc(sizeof(struct GamestateResources));
+	double trace = BeginTrace(game);
+	struct Arena* arena = CreateArena(game, "outro");
+	struct GamestateResources* data = ArenaAlloc(arena, sizeof(struct GamestateResources));
+	data->arena = arena;
+	SetAssetScope(game, "outro");
+	ExpectLoadingAssets(game, "outro");
+	data->menu = (struct FrameCache){0};
 	data->font = al_load_ttf_font(GetDataFilePath(game, "fonts/belligerent.ttf"), 48, 0);
 	progress(game); // report that we progressed with the loading, so the engine can draw a progress bar
 
@@ -253,32 +295,36 @@ void* Gamestate_Load(struct Game* game, void (*progress)(struct Game*)) {
 		data->used_female[i] = false;
 	}
 
-	data->bg = al_load_bitmap(GetDataFilePath(game, "cmentarz_tyl.png"));
-	data->bg2 = al_load_bitmap(GetDataFilePath(game, "cmentarz_przod.png"));
+	data->bg = LoadPrewarmedBitmap(game, "cmentarz_tyl.png");
+	data->bg2 = LoadPrewarmedBitmap(game, "cmentarz_przod.png");
 
-	data->photo1 = al_load_bitmap(GetDataFilePath(game, "polaroid_chlopczyk.png"));
-	data->photo2 = al_load_bitmap(GetDataFilePath(game, "polaroid_chlopczyk2.png"));
-	data->photogirl = al_load_bitmap(GetDataFilePath(game, "polaroid_dziewczynka.png"));
+	data->photo1 = LoadPrewarmedBitmap(game, "polaroid_chlopczyk.png");
+	data->photo2 = LoadPrewarmedBitmap(game, "polaroid_chlopczyk2.png");
+	data->photogirl = LoadPrewarmedBitmap(game, "polaroid_dziewczynka.png");
 
-	data->wstazka = al_load_bitmap(GetDataFilePath(game, "polaroid_kokardka.png"));
+	data->wstazka = LoadPrewarmedBitmap(game, "polaroid_kokardka.png");
 
 	data->click_sample = al_load_sample(GetDataFilePath(game, "click.flac"));
 	data->click = al_create_sample_instance(data->click_sample);
 	al_attach_sample_instance_to_mixer(data->click, game->audio.fx);
 	al_set_sample_instance_playmode(data->click, ALLEGRO_PLAYMODE_ONCE);
 
-	data->music = al_load_audio_stream(GetDataFilePath(game, "cannonfodder.ogg"), 4, 1024);
+	data->music = LoadPrewarmedAudioStream(game, "cannonfodder.ogg", 4, 1024);
 	al_set_audio_stream_playing(data->music, false);
 	al_attach_audio_stream_to_mixer(data->music, game->audio.music);
 	al_set_audio_stream_playmode(data->music, ALLEGRO_PLAYMODE_LOOP);
 
+	EndTrace(game, "outro Load", trace);
 	return data;
 }
 
 void Gamestate_PostLoad(struct Game* game, struct GamestateResources* data) {
+	double trace = BeginTrace(game);
+	SetResourceScope("outro");
 	data->tmp = CreateNotPreservedBitmap(300, 300);
 
-	data->bmp = CreateNotPreservedBitmap(1920 / 2 + 200, 100 + 300 * game->data->score + 550);
+	data->height = 100 + 300 * game->data->score + 550;
+	data->bmp = CreateRenderTarget(game, 1920 / 2 + 200, data->height, 1.0);
 	al_set_target_bitmap(data->bmp);
 	al_clear_to_color(al_map_rgba(0, 0, 0, 0));
 
@@ -386,6 +432,8 @@ void Gamestate_PostLoad(struct Game* game, struct GamestateResources* data) {
 	}
 
 	al_draw_text(data->font, al_map_rgb(0, 0, 0), 1920 / 2 - 100, 100 + 300 * game->data->score + 480, ALLEGRO_ALIGN_CENTER, "Fin.");
+	SetResourceScope(NULL);
+	EndTrace(game, "outro PostLoad", trace);
 }
 
 void Gamestate_Unload(struct Game* game, struct GamestateResources* data) {
@@ -393,6 +441,8 @@ void Gamestate_Unload(struct Game* game, struct GamestateResources* data) {
 	// Good place for freeing all allocated memory and resources.
 	al_destroy_font(data->font);
 	al_destroy_bitmap(data->tmp);
+	al_destroy_bitmap(data->bmp);
+	DestroyFrameCache(&data->menu);
 	al_destroy_bitmap(data->bg);
 	al_destroy_bitmap(data->bg2);
 	al_destroy_bitmap(data->photo1);
@@ -400,7 +450,10 @@ void Gamestate_Unload(struct Game* game, struct GamestateResources* data) {
 	al_destroy_bitmap(data->photogirl);
 	al_destroy_bitmap(data->wstazka);
 	al_destroy_audio_stream(data->music);
-	free(data);
+	al_destroy_sample_instance(data->click);
+	al_destroy_sample(data->click_sample);
+	TM_Destroy(data->credits);
+	DestroyArena(data->arena);
 }
 
 void Gamestate_Start(struct Game* game, struct GamestateResources* data) {
@@ -415,6 +468,7 @@ void Gamestate_Start(struct Game* game, struct GamestateResources* data) {
 	data->in = true;
 	data->choice = 0;
 	data->skipping = false;
+	InvalidateFrameCache(&data->menu);
 
 	data->creditnr = 0;
 	TM_AddDelay(data->credits, 1.0);
@@ -447,12 +501,19 @@ void Gamestate_Stop(struct Game* game, struct GamestateResources* data) {
 void Gamestate_Pause(struct Game* game, struct GamestateResources* data) {
 	// Called when gamestate gets paused (so only Draw is being called, no Logic not ProcessEvent)
 	// Pause your timers here.
+	data->resume_music = al_get_audio_stream_playing(data->music);
+	al_set_audio_stream_playing(data->music, false);
+	game->data->paused = true;
 }
 
 void Gamestate_Resume(struct Game* game, struct GamestateResources* data) {
 	// Called when gamestate gets resumed. Resume your timers here.
+	al_set_audio_stream_playing(data->music, data->resume_music);
+	game->data->paused = false;
 }
 
 // Ignore this for now.
 // TODO: Check, comment, refine and/or remove:
-void Gamestate_Reload(struct Game* game, struct GamestateResources* data) {}
+void Gamestate_Reload(struct Game* game, struct GamestateResources* data) {
+	InvalidateFrameCache(&data->menu);
+}
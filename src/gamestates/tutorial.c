@@ -28,8 +28,11 @@ struct GamestateResources {
 	// It gets created on load and then gets passed around to all other function calls.
 	ALLEGRO_BITMAP *bmp, *fg, *left, *right, *anykey;
 	ALLEGRO_AUDIO_STREAM* elevator;
+	struct FrameCache frame;
 
 	int counter;
+
+	struct Arena* arena;
 };
 
 int Gamestate_ProgressCount = 5; // number of loading steps as reported by Gamestate_Load
@@ -38,21 +41,43 @@ void Gamestate_Logic(struct Game* game, struct GamestateResources* data, double
 
 void Gamestate_Tick(struct Game* game, struct GamestateResources* data) {
 	// Called 60 times per second. Here you should do all your game logic.
+	if (SkipEngineStep(game)) {
+		return; // run by StepExport instead
+	}
+	double trace = BeginTrace(game);
 	data->counter++;
+	EndTrace(game, "tutorial Tick", trace);
 }
 
 void Gamestate_Draw(struct Game* game, struct GamestateResources* data) {
 	// Called as soon as possible, but no sooner than next Gamestate_Logic call.
 	// Draw everything to the screen here.
-	al_draw_bitmap(data->bmp, 0, 0, 0);
-	al_draw_bitmap(data->fg, -240 + sin(data->counter / 1.5) * 2, -160 + cos(data->counter / 4.0) * 1.5, 0);
-
-	al_draw_rotated_bitmap(data->left, 1160 - 1081, 525 - 161, 1160, 525, sin(data->counter / 12.0) / 32.0, 0);
-	al_draw_rotated_bitmap(data->right, 1160 - 1343, 525 - 266, 1160, 525, -sin(data->counter / 12.0) / 32.0, 0);
-
-	if (data->counter % 80 < 65) {
-		al_draw_bitmap(data->anykey, 1230, 970, 0);
+	double trace = BeginTrace(game);
+	SetFramebufferAsTarget(game);
+	float x = -240 + sin(data->counter / 1.5) * 2, y = -160 + cos(data->counter / 4.0) * 1.5;
+	float angle = sin(data->counter / 12.0) / 32.0;
+	bool anykey = data->counter % 80 < 65;
+
+	// Redraw only when something moved by at least a pixel; the arrow tips are about
+	// 400 px away from the pivot, so 1/800 rad is half a pixel there.
+	unsigned long long signature = ((unsigned long long)(lround(x) & 0xFF) << 24) | ((lround(y) & 0xFF) << 16) |
+		((lround(angle * 800) & 0x7FFF) << 1) | anykey;
+
+	BeginOverdraw(game);
+	if (BeginCachedFrame(game, &data->frame, signature)) {
+		DrawLayer(game, "bg", data->bmp, 0, 0);
+		DrawLayer(game, "fg", data->fg, x, y);
+
+		DrawRotatedLayer(game, "left", data->left, 1160 - 1081, 525 - 161, 1160, 525, angle);
+		DrawRotatedLayer(game, "right", data->right, 1160 - 1343, 525 - 266, 1160, 525, -angle);
+
+		if (anykey) {
+			DrawLayer(game, "anykey", data->anykey, 1230, 970);
+		}
 	}
+	FinishCachedFrame(game, &data->frame);
+	FinishOverdraw(game);
+	EndTrace(game, "tutorial Draw", trace);
 }
 
 void Gamestate_ProcessEvent(struct Game* game, struct GamestateResources* data, ALLEGRO_EVENT* ev) {
@@ -60,6 +85,7 @@ void Gamestate_ProcessEvent(struct Game* game, struct GamestateResources* data,
 	// Here you can handle user input, expiring timers etc.
 	if (((ev->type == ALLEGRO_EVENT_KEY_DOWN) && (ev->keyboard.keycode != ALLEGRO_KEY_TILDE)) || (ev->type == ALLEGRO_EVENT_JOYSTICK_BUTTON_DOWN) ||
 		(ev->type == ALLEGRO_EVENT_TOUCH_BEGIN)) {
+		TraceInstant(game, "switch to disco");
 		SwitchCurrentGamestate(game, "disco");
 	}
 }
@@ -67,16 +93,22 @@ void Gamestate_ProcessEvent(struct Game* game, struct GamestateResources* data,
 void* Gamestate_Load(struct Game* game, void (*progress)(struct Game*)) {
 	// Called once, when the gamestate library is being loaded.
 	// Good place for allocating memory, loading bitmaps etc.
-	struct GamestateResources* data = malloc(sizeof(struct GamestateResources));
-	data->bmp = al_load_bitmap(GetDataFilePath(game, "tutorial.png"));
+	double trace = BeginTrace(game);
+	struct Arena* arena = CreateArena(game, "tutorial");
+	struct GamestateResources* data = ArenaAlloc(arena, sizeof(struct GamestateResources));
+	data->arena = arena;
+	SetAssetScope(game, "tutorial");
+	ExpectLoadingAssets(game, "tutorial");
+	data->frame = (struct FrameCache){0};
+	data->bmp = LoadPrewarmedBitmap(game, "tutorial.png");
 	progress(game); // report that we progressed with the loading, so the engine can draw a progress bar
-	data->fg = al_load_bitmap(GetDataFilePath(game, "tutorialfg.png"));
+	data->fg = LoadPrewarmedBitmap(game, "tutorialfg.png");
 	progress(game); // report that we progressed with the loading, so the engine can draw a progress bar
-	data->left = al_load_bitmap(GetDataFilePath(game, "tutorialleft.png"));
+	data->left = LoadPrewarmedBitmap(game, "tutorialleft.png");
 	progress(game); // report that we progressed with the loading, so the engine can draw a progress bar
-	data->right = al_load_bitmap(GetDataFilePath(game, "tutorialright.png"));
+	data->right = LoadPrewarmedBitmap(game, "tutorialright.png");
 	progress(game); // report that we progressed with the loading, so the engine can draw a progress bar
-	data->anykey = al_load_bitmap(GetDataFilePath(game, "anykey.png"));
+	data->anykey = LoadPrewarmedBitmap(game, "anykey.png");
 	progress(game); // report that we progressed with the loading, so the engine can draw a progress bar
 
 	data->elevator = al_load_audio_stream(GetDataFilePath(game, "elevator.flac"), 4, 1024);
@@ -85,6 +117,7 @@ void* Gamestate_Load(struct Game* game, void (*progress)(struct Game*)) {
 	al_set_audio_stream_gain(data->elevator, 0.8);
 	al_set_audio_stream_playmode(data->elevator, ALLEGRO_PLAYMODE_LOOP);
 
+	EndTrace(game, "tutorial Load", trace);
 	return data;
 }
 
@@ -97,13 +130,15 @@ void Gamestate_Unload(struct Game* game, struct GamestateResources* data) {
 	al_destroy_bitmap(data->right);
 	al_destroy_bitmap(data->anykey);
 	al_destroy_audio_stream(data->elevator);
-	free(data);
+	DestroyFrameCache(&data->frame);
+	DestroyArena(data->arena);
 }
 
 void Gamestate_Start(struct Game* game, struct GamestateResources* data) {
 	// Called when this gamestate gets control. Good place for initializing state,
 	// playing music etc.
 	al_set_audio_stream_playing(data->elevator, true);
+	InvalidateFrameCache(&data->frame);
 	data->counter = 0;
 }
 
@@ -115,12 +150,18 @@ void Gamestate_Stop(struct Game* game, struct GamestateResources* data) {
 void Gamestate_Pause(struct Game* game, struct GamestateResources* data) {
 	// Called when gamestate gets paused (so only Draw is being called, no Logic not ProcessEvent)
 	// Pause your timers here.
+	al_set_audio_stream_playing(data->elevator, false);
+	game->data->paused = true;
 }
 
 void Gamestate_Resume(struct Game* game, struct GamestateResources* data) {
 	// Called when gamestate gets resumed. Resume your timers here.
+	al_set_audio_stream_playing(data->elevator, true);
+	game->data->paused = false;
 }
 
 // Ignore this for now.
 // TODO: Check, comment, refine and/or remove:
-void Gamestate_Reload(struct Game* game, struct GamestateResources* data) {}
+void Gamestate_Reload(struct Game* game, struct GamestateResources* data) {
+	InvalidateFrameCache(&data->frame);
+}
@@ -0,0 +1,124 @@
+/*! \file headless.c
+ *  \brief Windowless rendering for benchmarking.
+ */
+/*
+ * Copyright (c) Sebastian Krzyszkowiak <dos@dosowisko.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "common.h"
+#include <allegro5/allegro_opengl.h>
+#include <libsuperderpy.h>
+
+// With --headless, the display gets created without any window system: SDL's
+// offscreen video driver renders into an EGL pbuffer and Mesa's llvmpipe does the
+// rendering, so the same OpenGL path as on screen runs the same way on any machine,
+// GPU or not. Frames are drawn into the canvas (see canvas.c) instead of the
+// framebuffer, each one gets timed and checksummed into a CSV file, and nothing
+// gets presented.
+
+void PrepareHeadless(void) {
+	// Has to be called before libsuperderpy_init creates the display. Anything
+	// already set in the environment takes precedence.
+	setenv("SDL_VIDEODRIVER", "offscreen", 0);
+	setenv("EGL_PLATFORM", "surfaceless", 0);
+	setenv("LIBGL_ALWAYS_SOFTWARE", "1", 0);
+	setenv("GALLIUM_DRIVER", "llvmpipe", 0);
+}
+
+void StartHeadless(struct Game* game, const char* filename) {
+	// Frame stats are only written when given a filename.
+	struct Headless* headless = &game->data->headless;
+	if (filename) {
+		headless->out = fopen(filename, "w");
+		if (!headless->out) {
+			PrintConsole(game, "Could not write frame stats to %s", filename);
+			return;
+		}
+		fprintf(headless->out, "frame,draw_ms,checksum_ms,checksum\n");
+	}
+	headless->output = filename;
+	headless->enabled = true;
+
+#ifndef ALLEGRO_SDL
+	PrintConsole(game, "Headless: Allegro was built without SDL, so the display still needs a window system (try xvfb-run)");
+#endif
+
+	// frames should come as fast as they can be drawn
+	game->data->idle_fps = 0;
+	game->data->static_fps = 0;
+}
+
+void BeginHeadlessFrame(struct Game* game) {
+	struct Headless* headless = &game->data->headless;
+	if (!headless->enabled) {
+		return;
+	}
+	headless->start = al_get_time();
+}
+
+static uint32_t ChecksumBitmap(ALLEGRO_BITMAP* bitmap) {
+	ALLEGRO_LOCKED_REGION* region = al_lock_bitmap(bitmap, ALLEGRO_PIXEL_FORMAT_ABGR_8888, ALLEGRO_LOCK_READONLY);
+	uint32_t hash = 2166136261u;
+	for (int y = 0; y < al_get_bitmap_height(bitmap); y++) {
+		hash = HashState(hash, (char*)region->data + y * region->pitch, al_get_bitmap_width(bitmap) * region->pixel_size);
+	}
+	al_unlock_bitmap(bitmap);
+	return hash;
+}
+
+void FinishHeadlessFrame(struct Game* game) {
+	// Also counts frames for --frames, headless or not.
+	struct Headless* headless = &game->data->headless;
+	headless->frames++;
+	if (headless->enabled) {
+		// Drawing only queues the commands, so wait until they're done (llvmpipe
+		// included) before stopping the clock.
+		if (al_get_display_flags(game->display) & ALLEGRO_OPENGL) {
+			glFinish();
+		} else {
+			al_lock_bitmap(game->data->canvas, ALLEGRO_PIXEL_FORMAT_ANY, ALLEGRO_LOCK_READONLY);
+			al_unlock_bitmap(game->data->canvas);
+		}
+		double ms = (al_get_time() - headless->start) * 1000.0;
+		headless->sum += ms;
+		if (ms > headless->max) {
+			headless->max = ms;
+		}
+		if (headless->out) {
+			double start = al_get_time();
+			uint32_t checksum = ChecksumBitmap(game->data->canvas);
+			fprintf(headless->out, "%d,%.3f,%.3f,%08x\n", headless->frames, ms, (al_get_time() - start) * 1000.0, checksum);
+		}
+	}
+	if (headless->limit && headless->frames >= headless->limit) {
+		QuitGame(game, false);
+	}
+}
+
+void FinishHeadless(struct Game* game) {
+	struct Headless* headless = &game->data->headless;
+	if (!headless->enabled) {
+		return;
+	}
+	headless->enabled = false;
+	PrintConsole(game, "Headless: %d frames, %.2f ms mean, %.2f ms max", headless->frames,
+		headless->frames ? headless->sum / headless->frames : 0, headless->max);
+	if (headless->out) {
+		fclose(headless->out);
+		PrintConsole(game, "Frame stats written to %s", headless->output);
+	}
+}
@@ -24,6 +24,7 @@
 #include <libsuperderpy.h>
 #include <signal.h>
 #include <stdio.h>
+#include <string.h>
 
 static _Noreturn void derp(int sig) {
 	ssize_t __attribute__((unused)) n = write(STDERR_FILENO, "Segmentation fault\nI just don't know what went wrong!\n", 54);
@@ -38,6 +39,12 @@ int main(int argc, char** argv) {
 	al_set_org_name("dosowisko.net");
 	al_set_app_name(LIBSUPERDERPY_GAMENAME_PRETTY);
 
+	for (int i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "--headless", 10) || !strncmp(argv[i], "--export", 8)) {
+			PrepareHeadless();
+		}
+	}
+
 	struct Game* game = libsuperderpy_init(argc, argv, LIBSUPERDERPY_GAMENAME,
 		(struct Params){
 			1920,
@@ -45,16 +52,71 @@ int main(int argc, char** argv) {
 			.handlers = (struct Handlers){
 				.event = GlobalEventHandler,
 				.destroy = DestroyGameData,
+				.predraw = PreDrawHandler,
+				.postdraw = PostDrawHandler,
 			},
 		});
 	if (!game) { return 1; }
 
+#ifdef STATIC_GAMESTATES
+	RegisterStaticGamestates(game);
+#endif
+
 	LoadGamestate(game, "dosowisko");
 	LoadGamestate(game, "holypangolin");
 	StartGamestate(game, "dosowisko");
 
 	game->data = CreateGameData(game);
 
+	const char* export = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "--trace", 7)) {
+			StartTrace(game, (argv[i][7] == '=') ? &argv[i][8] : "trace.json");
+		}
+		if (!strncmp(argv[i], "--record", 8)) {
+			StartReplay(game, (argv[i][8] == '=') ? &argv[i][9] : "session.replay", true);
+		}
+		if (!strncmp(argv[i], "--replay", 8)) {
+			StartReplay(game, (argv[i][8] == '=') ? &argv[i][9] : "session.replay", false);
+		}
+		if (!strncmp(argv[i], "--headless", 10)) {
+			StartHeadless(game, (argv[i][10] == '=') ? &argv[i][11] : "frames.csv");
+		}
+		if (!strncmp(argv[i], "--export", 8)) {
+			export = (argv[i][8] == '=') ? &argv[i][9] : "export";
+		}
+		if (!strncmp(argv[i], "--frames=", 9)) {
+			game->data->headless.limit = strtol(&argv[i][9], NULL, 10);
+		}
+		if (!strncmp(argv[i], "--asset-report", 14)) {
+			// Load every gamestate up front, write the report once they're done and quit.
+			StartAssetReport(game, (argv[i][14] == '=') ? &argv[i][15] : "asset-report.csv");
+			game->data->prewarm.limit = 0;
+			LoadGamestate(game, "intro");
+			LoadGamestate(game, "tutorial");
+			LoadGamestate(game, "disco");
+			LoadGamestate(game, "outro");
+		}
+	}
+
+	if (export && !game->data->headless.enabled) {
+		StartHeadless(game, NULL); // exports are drawn into the headless canvas
+	}
+
+	// before anything gets loaded, but after --headless got its say
+	CreateCanvas(game);
+	if (export) {
+		StartExport(game, export);
+	}
+	SelectAssetTier(game);
+	CreateMaskShader(game);
+	StartSpectrum(game);
+
+	// The splash screens take about 10 seconds; decode what comes after them meanwhile.
+	PrewarmGamestate(game, "intro");
+	PrewarmGamestate(game, "tutorial");
+	PrewarmGamestate(game, "disco");
+
 	al_hide_mouse_cursor(game->display);
 
 	return libsuperderpy_run(game);
@@ -0,0 +1,152 @@
+/*! \file masks.c
+ *  \brief Single channel textures for alpha masks and the shaders drawing them.
+ */
+/*
+ * Copyright (c) Sebastian Krzyszkowiak <dos@dosowisko.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "common.h"
+#include <libsuperderpy.h>
+
+// Bitmaps loaded with LoadMaskBitmap only keep their alpha, in a single channel
+// texture a quarter the size of an RGBA one. Allegro samples such textures into
+// the red channel, so they have to be drawn between BeginMaskDrawing and
+// EndMaskDrawing, which swap in a shader that turns it into the alpha of black.
+// That makes them usable both as masks under ALLEGRO_ZERO, ALLEGRO_ALPHA
+// blending and as shadows under the regular one.
+//
+// Without OpenGL shaders masks are loaded as they are and the shader is never
+// used. The same goes for any other shader made with CreatePixelShader.
+
+static const char* MASK_PIXEL_SHADER =
+	"#ifdef GL_ES\n"
+	"precision mediump float;\n"
+	"#endif\n"
+	"uniform sampler2D al_tex;\n"
+	"varying vec4 varying_color;\n"
+	"varying vec2 varying_texcoord;\n"
+	"void main() {\n"
+	"	gl_FragColor = vec4(0.0, 0.0, 0.0, texture2D(al_tex, varying_texcoord).r * varying_color.a);\n"
+	"}\n";
+
+ALLEGRO_SHADER* CreatePixelShader(struct Game* game, const char* source) {
+	// Returns NULL when GLSL shaders can't be used, callers are expected to draw without them then.
+	if (!(al_get_display_flags(game->display) & ALLEGRO_OPENGL)) {
+		return NULL;
+	}
+	ALLEGRO_SHADER* shader = al_create_shader(ALLEGRO_SHADER_GLSL);
+	if (!shader) {
+		return NULL;
+	}
+	if (!al_attach_shader_source(shader, ALLEGRO_VERTEX_SHADER, al_get_default_shader_source(ALLEGRO_SHADER_GLSL, ALLEGRO_VERTEX_SHADER)) ||
+		!al_attach_shader_source(shader, ALLEGRO_PIXEL_SHADER, source) || !al_build_shader(shader)) {
+		PrintConsole(game, "Could not build a shader: %s", al_get_shader_log(shader));
+		al_destroy_shader(shader);
+		return NULL;
+	}
+	return shader;
+}
+
+void CreateMaskShader(struct Game* game) {
+	game->data->mask_shader = CreatePixelShader(game, MASK_PIXEL_SHADER);
+}
+
+void DestroyMaskShader(struct Game* game) {
+	if (game->data->mask_shader) {
+		al_destroy_shader(game->data->mask_shader);
+		game->data->mask_shader = NULL;
+	}
+}
+
+ALLEGRO_BITMAP* CreateChannelBitmap(int width, int height, const uint8_t* values) {
+	// Uploads width x height bytes into a single channel texture. Drivers without
+	// those get the value copied into every channel of an RGBA one instead, which
+	// reads the same from red.
+	int format = al_get_new_bitmap_format();
+	al_set_new_bitmap_format(ALLEGRO_PIXEL_FORMAT_SINGLE_CHANNEL_8);
+	ALLEGRO_BITMAP* bitmap = al_create_bitmap(width, height);
+	al_set_new_bitmap_format(format);
+	if (!bitmap) {
+		bitmap = al_create_bitmap(width, height);
+		if (!bitmap) {
+			return NULL;
+		}
+	}
+	int size = (al_get_bitmap_format(bitmap) == ALLEGRO_PIXEL_FORMAT_SINGLE_CHANNEL_8) ? 1 : 4;
+	ALLEGRO_LOCKED_REGION* region = al_lock_bitmap(bitmap, (size == 1) ? ALLEGRO_PIXEL_FORMAT_SINGLE_CHANNEL_8 : ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_WRITEONLY);
+	if (!region) {
+		al_destroy_bitmap(bitmap);
+		return NULL;
+	}
+	for (int y = 0; y < height; y++) {
+		uint8_t* row = (uint8_t*)region->data + y * region->pitch;
+		for (int x = 0; x < width; x++) {
+			for (int c = 0; c < size; c++) {
+				row[x * size + c] = values[y * width + x];
+			}
+		}
+	}
+	al_unlock_bitmap(bitmap);
+	return bitmap;
+}
+
+ALLEGRO_BITMAP* LoadMaskBitmap(struct Game* game, const char* filename) {
+	if (!game->data->mask_shader) {
+		return LoadPrewarmedBitmap(game, filename);
+	}
+
+	int flags = al_get_new_bitmap_flags();
+	al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+	ALLEGRO_BITMAP* source = LoadPrewarmedBitmap(game, filename);
+	al_set_new_bitmap_flags(flags);
+	if (!source) {
+		return NULL;
+	}
+	MarkMaskAsset(game, filename);
+	int width = al_get_bitmap_width(source), height = al_get_bitmap_height(source);
+	ALLEGRO_LOCKED_REGION* region = al_lock_bitmap(source, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_READONLY);
+	if (!region) {
+		al_destroy_bitmap(source);
+		return NULL;
+	}
+	uint8_t* alpha = malloc(width * height);
+	for (int y = 0; y < height; y++) {
+		uint8_t* row = (uint8_t*)region->data + y * region->pitch;
+		for (int x = 0; x < width; x++) {
+			alpha[y * width + x] = row[x * 4 + 3];
+		}
+	}
+	al_unlock_bitmap(source);
+	al_destroy_bitmap(source);
+
+	ALLEGRO_BITMAP* mask = CreateChannelBitmap(width, height, alpha);
+	free(alpha);
+	return mask;
+}
+
+void BeginMaskDrawing(struct Game* game) {
+	// Applies to the current target only, so switch targets after EndMaskDrawing.
+	if (game->data->mask_shader) {
+		al_use_shader(game->data->mask_shader);
+	}
+}
+
+void EndMaskDrawing(struct Game* game) {
+	if (game->data->mask_shader) {
+		al_use_shader(NULL);
+	}
+}
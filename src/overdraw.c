@@ -0,0 +1,196 @@
+/*! \file overdraw.c
+ *  \brief Overdraw heatmap debug view.
+ */
+/*
+ * Copyright (c) Sebastian Krzyszkowiak <dos@dosowisko.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "common.h"
+#include <libsuperderpy.h>
+#include <math.h>
+#include <string.h>
+
+// Every recorded quad adds one to the heatmap, so it holds the number of times
+// each pixel has been written in the current frame. Only quads drawn into the
+// framebuffer between BeginOverdraw and FinishOverdraw are recorded; drawing
+// into offscreen targets shows up once their contents get composited.
+
+static double ClippedArea(struct Game* game, float* points) {
+	// Sutherland-Hodgman against the viewport, then shoelace formula.
+	float poly[2][16 * 2];
+	int count = 4;
+	memcpy(poly[0], points, sizeof(float) * 8);
+	float limits[4] = {0, 0, game->viewport.width, game->viewport.height};
+
+	for (int edge = 0; edge < 4; edge++) {
+		float* in = poly[edge % 2];
+		float* out = poly[(edge + 1) % 2];
+		int axis = edge % 2;
+		bool max = edge >= 2;
+		int n = 0;
+		for (int i = 0; i < count; i++) {
+			float* a = &in[i * 2];
+			float* b = &in[((i + 1) % count) * 2];
+			bool ina = max ? (a[axis] <= limits[edge]) : (a[axis] >= limits[edge]);
+			bool inb = max ? (b[axis] <= limits[edge]) : (b[axis] >= limits[edge]);
+			if (ina) {
+				out[n * 2] = a[0];
+				out[n * 2 + 1] = a[1];
+				n++;
+			}
+			if (ina != inb) {
+				float t = (limits[edge] - a[axis]) / (b[axis] - a[axis]);
+				out[n * 2] = a[0] + (b[0] - a[0]) * t;
+				out[n * 2 + 1] = a[1] + (b[1] - a[1]) * t;
+				n++;
+			}
+		}
+		count = n;
+	}
+
+	double area = 0;
+	for (int i = 0; i < count; i++) {
+		float* a = &poly[0][i * 2];
+		float* b = &poly[0][((i + 1) % count) * 2];
+		area += a[0] * b[1] - b[0] * a[1];
+	}
+	return fabs(area) / 2.0;
+}
+
+void RecordOverdrawQuad(struct Game* game, const char* name, float* points) {
+	struct Overdraw* overdraw = &game->data->overdraw;
+	if (!overdraw->enabled || !overdraw->recording || (al_get_target_bitmap() != overdraw->target)) {
+		return;
+	}
+
+	int layer;
+	for (layer = 0; layer < overdraw->count; layer++) {
+		if (strcmp(overdraw->layers[layer].name, name) == 0) {
+			break;
+		}
+	}
+	if (layer == overdraw->count) {
+		if (overdraw->count == OVERDRAW_MAX_LAYERS) {
+			return;
+		}
+		overdraw->layers[layer].name = name;
+		overdraw->layers[layer].pixels = 0;
+		overdraw->count++;
+	}
+	overdraw->layers[layer].pixels += ClippedArea(game, points);
+
+	ALLEGRO_BITMAP* target = al_get_target_bitmap();
+	int op, src, dst;
+	al_get_blender(&op, &src, &dst);
+	al_set_target_bitmap(overdraw->heatmap);
+	al_set_blender(ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_ONE);
+
+	ALLEGRO_COLOR one = al_map_rgba(1, 1, 1, 1);
+	ALLEGRO_VERTEX vertices[4];
+	for (int i = 0; i < 4; i++) {
+		vertices[i] = (ALLEGRO_VERTEX){.x = points[i * 2], .y = points[i * 2 + 1], .z = 0, .color = one};
+	}
+	al_draw_prim(vertices, NULL, NULL, 0, 4, ALLEGRO_PRIM_TRIANGLE_FAN);
+
+	al_set_blender(op, src, dst);
+	al_set_target_bitmap(target);
+}
+
+void RecordOverdraw(struct Game* game, const char* name, float x, float y, float width, float height) {
+	float points[8] = {x, y, x + width, y, x + width, y + height, x, y + height};
+	RecordOverdrawQuad(game, name, points);
+}
+
+void BeginOverdraw(struct Game* game) {
+	struct Overdraw* overdraw = &game->data->overdraw;
+	if (!overdraw->enabled) {
+		return;
+	}
+	if (!overdraw->heatmap) {
+		// quarter resolution is plenty for a heatmap and keeps the readback cheap
+		overdraw->heatmap = CreateRenderTarget(game, game->viewport.width, game->viewport.height, 0.25);
+		overdraw->view = al_create_bitmap(al_get_bitmap_width(overdraw->heatmap), al_get_bitmap_height(overdraw->heatmap));
+		overdraw->font = al_create_builtin_font();
+	}
+	overdraw->count = 0;
+	overdraw->recording = true;
+
+	ALLEGRO_BITMAP* target = al_get_target_bitmap();
+	al_set_target_bitmap(overdraw->heatmap);
+	al_clear_to_color(al_map_rgba(0, 0, 0, 0));
+	al_set_target_bitmap(target);
+}
+
+static ALLEGRO_COLOR HeatColor(int count) {
+	static const unsigned char ramp[][3] = {
+		{0, 0, 0}, {0, 0, 160}, {0, 160, 0}, {200, 200, 0}, {255, 128, 0}, {255, 0, 0}, {255, 0, 255}, {255, 255, 255}};
+	int steps = sizeof(ramp) / sizeof(ramp[0]);
+	if (count >= steps) {
+		count = steps - 1;
+	}
+	return al_map_rgb(ramp[count][0], ramp[count][1], ramp[count][2]);
+}
+
+void FinishOverdraw(struct Game* game) {
+	struct Overdraw* overdraw = &game->data->overdraw;
+	overdraw->recording = false;
+	if (!overdraw->enabled || !overdraw->heatmap) {
+		return;
+	}
+
+	int width = al_get_bitmap_width(overdraw->heatmap), height = al_get_bitmap_height(overdraw->heatmap);
+	al_lock_bitmap(overdraw->heatmap, ALLEGRO_PIXEL_FORMAT_ANY, ALLEGRO_LOCK_READONLY);
+	al_set_target_bitmap(overdraw->view);
+	al_lock_bitmap(overdraw->view, ALLEGRO_PIXEL_FORMAT_ANY, ALLEGRO_LOCK_WRITEONLY);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			unsigned char r, g, b, a;
+			al_unmap_rgba(al_get_pixel(overdraw->heatmap, x, y), &r, &g, &b, &a);
+			al_put_pixel(x, y, HeatColor(r));
+		}
+	}
+	al_unlock_bitmap(overdraw->view);
+	al_unlock_bitmap(overdraw->heatmap);
+
+	SetFramebufferAsTarget(game);
+	al_draw_scaled_bitmap(overdraw->view, 0, 0, width, height, 0, 0, game->viewport.width, game->viewport.height, 0);
+
+	double screen = game->viewport.width * game->viewport.height;
+	double total = 0;
+	for (int i = 0; i < overdraw->count; i++) {
+		total += overdraw->layers[i].pixels;
+		al_draw_textf(overdraw->font, al_map_rgb(255, 255, 255), 20, 20 + i * 20, ALLEGRO_ALIGN_LEFT, "%-12s %6.2fx", overdraw->layers[i].name, overdraw->layers[i].pixels / screen);
+	}
+	al_draw_textf(overdraw->font, al_map_rgb(255, 255, 255), 20, 20 + overdraw->count * 20, ALLEGRO_ALIGN_LEFT, "%-12s %6.2fx", "total", total / screen);
+
+	if (overdraw->dump) {
+		overdraw->dump = false;
+		for (int i = 0; i < overdraw->count; i++) {
+			PrintConsole(game, "overdraw: %s %.0f px (%.2fx)", overdraw->layers[i].name, overdraw->layers[i].pixels, overdraw->layers[i].pixels / screen);
+		}
+		PrintConsole(game, "overdraw: total %.0f px (%.2fx)", total, total / screen);
+	}
+}
+
+void DestroyOverdraw(struct Game* game) {
+	struct Overdraw* overdraw = &game->data->overdraw;
+	if (overdraw->heatmap) {
+		al_destroy_bitmap(overdraw->heatmap);
+		al_destroy_bitmap(overdraw->view);
+		al_destroy_font(overdraw->font);
+	}
+}
@@ -0,0 +1,151 @@
+/*! \file particles.c
+ *  \brief Pooled particles kept in structure-of-arrays layout.
+ */
+/*
+ * Copyright (c) Sebastian Krzyszkowiak <dos@dosowisko.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "common.h"
+#include <libsuperderpy.h>
+#include <math.h>
+
+// All memory is allocated up front: one float array per particle attribute,
+// sized for the whole pool, plus vertices for a single batch. Live particles
+// are packed at the start of the arrays, so the update is a handful of
+// straight loops the compiler can vectorize. Dead ones get replaced with the
+// last live one. Emitting into a full pool drops the new particles.
+// Particles are drawn as untextured quads, PARTICLE_BATCH of them per call.
+
+struct Particles* CreateParticles(int capacity) {
+	struct Particles* particles = calloc(1, sizeof(struct Particles));
+	particles->capacity = capacity;
+	particles->block = malloc(sizeof(float) * capacity * PARTICLE_FIELDS);
+	for (int f = 0; f < PARTICLE_FIELDS; f++) {
+		particles->fields[f] = particles->block + f * capacity;
+	}
+	particles->vertices = malloc(sizeof(ALLEGRO_VERTEX) * PARTICLE_BATCH * 4);
+	particles->indices = malloc(sizeof(int) * PARTICLE_BATCH * 6);
+	for (int i = 0; i < PARTICLE_BATCH; i++) {
+		int quad[6] = {0, 1, 2, 0, 2, 3};
+		for (int k = 0; k < 6; k++) {
+			particles->indices[i * 6 + k] = i * 4 + quad[k];
+		}
+		for (int k = 0; k < 4; k++) {
+			particles->vertices[i * 4 + k] = (ALLEGRO_VERTEX){0};
+		}
+	}
+	particles->rng = 0x9e3779b9;
+	return particles;
+}
+
+static float RandomRange(struct Particles* particles, float min, float max) {
+	return min + (max - min) * (Random(&particles->rng) / (float)RANDOM_MAX);
+}
+
+void EmitParticles(struct Particles* particles, const struct ParticleStyle* style, float x, float y, int count) {
+	// Speed, size and lifetime vary between half and one and a half of what the style says.
+	float** f = particles->fields;
+	for (int n = 0; (n < count) && (particles->count < particles->capacity); n++) {
+		int i = particles->count++;
+		float angle = style->direction + RandomRange(particles, -0.5, 0.5) * style->spread;
+		float speed = style->speed * RandomRange(particles, 0.5, 1.5);
+		f[PARTICLE_X][i] = x + RandomRange(particles, -0.5, 0.5) * style->area;
+		f[PARTICLE_Y][i] = y + RandomRange(particles, -0.5, 0.5) * style->area;
+		f[PARTICLE_VX][i] = cos(angle) * speed;
+		f[PARTICLE_VY][i] = sin(angle) * speed;
+		f[PARTICLE_GRAVITY][i] = style->gravity;
+		f[PARTICLE_DRAG][i] = style->drag;
+		f[PARTICLE_SIZE][i] = style->size * RandomRange(particles, 0.5, 1.5);
+		f[PARTICLE_TTL][i] = style->life * RandomRange(particles, 0.5, 1.5);
+		f[PARTICLE_LIFE][i] = f[PARTICLE_TTL][i];
+		f[PARTICLE_R][i] = style->r;
+		f[PARTICLE_G][i] = style->g;
+		f[PARTICLE_B][i] = style->b;
+		f[PARTICLE_A][i] = style->a;
+	}
+}
+
+static void MoveParticles(int count, float delta, float* restrict x, float* restrict y, float* restrict vx, float* restrict vy,
+	float* restrict life, const float* restrict gravity, const float* restrict drag) {
+	// Every field is its own array, so nothing here aliases and both loops vectorize.
+	for (int i = 0; i < count; i++) {
+		vx[i] -= vx[i] * drag[i] * delta;
+		vy[i] += (gravity[i] - vy[i] * drag[i]) * delta;
+	}
+	for (int i = 0; i < count; i++) {
+		x[i] += vx[i] * delta;
+		y[i] += vy[i] * delta;
+		life[i] -= delta;
+	}
+}
+
+void UpdateParticles(struct Particles* particles, float delta) {
+	float** f = particles->fields;
+	MoveParticles(particles->count, delta, f[PARTICLE_X], f[PARTICLE_Y], f[PARTICLE_VX], f[PARTICLE_VY],
+		f[PARTICLE_LIFE], f[PARTICLE_GRAVITY], f[PARTICLE_DRAG]);
+
+	// Dead particles get replaced by the last one, which then gets checked in their place.
+	for (int i = 0; i < particles->count;) {
+		if (f[PARTICLE_LIFE][i] > 0) {
+			i++;
+			continue;
+		}
+		int last = --particles->count;
+		for (int field = 0; field < PARTICLE_FIELDS; field++) {
+			f[field][i] = f[field][last];
+		}
+	}
+}
+
+void DrawParticles(struct Particles* particles) {
+	// Colors fade out with the remaining lifetime.
+	float** f = particles->fields;
+	for (int start = 0; start < particles->count; start += PARTICLE_BATCH) {
+		int n = particles->count - start;
+		if (n > PARTICLE_BATCH) {
+			n = PARTICLE_BATCH;
+		}
+		for (int k = 0; k < n; k++) {
+			int i = start + k;
+			float alpha = f[PARTICLE_A][i] * f[PARTICLE_LIFE][i] / f[PARTICLE_TTL][i];
+			ALLEGRO_COLOR color = al_map_rgba_f(f[PARTICLE_R][i] * alpha, f[PARTICLE_G][i] * alpha, f[PARTICLE_B][i] * alpha, alpha);
+			float x = f[PARTICLE_X][i], y = f[PARTICLE_Y][i], s = f[PARTICLE_SIZE][i] / 2.0;
+			ALLEGRO_VERTEX* v = &particles->vertices[k * 4];
+			v[0].x = x - s;
+			v[0].y = y - s;
+			v[1].x = x + s;
+			v[1].y = y - s;
+			v[2].x = x + s;
+			v[2].y = y + s;
+			v[3].x = x - s;
+			v[3].y = y + s;
+			v[0].color = v[1].color = v[2].color = v[3].color = color;
+		}
+		al_draw_indexed_prim(particles->vertices, NULL, NULL, particles->indices, n * 6, ALLEGRO_PRIM_TRIANGLE_LIST);
+	}
+}
+
+void ClearParticles(struct Particles* particles) {
+	particles->count = 0;
+}
+
+void DestroyParticles(struct Particles* particles) {
+	free(particles->block);
+	free(particles->vertices);
+	free(particles->indices);
+	free(particles);
+}
@@ -0,0 +1,421 @@
+/*! \file prewarm.c
+ *  \brief Background decoding of the next gamestate's assets.
+ */
+/*
+ * Copyright (c) Sebastian Krzyszkowiak <dos@dosowisko.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "common.h"
+#include <libsuperderpy.h>
+#include <string.h>
+
+#undef GetDataFilePath // files only count as requested once they're claimed, see TrackDataFilePath
+
+// A gamestate names its likely successor with PrewarmGamestate. The successor's
+// assets are listed in data/prewarm.ini and get decoded by a worker thread into
+// memory bitmaps and file buffers, so its Gamestate_Load only has to upload them.
+// Requests are served in the order they were made, each one only once there's
+// room for it under the memory cap.
+
+static bool IsBitmap(const char* name) {
+	const char* ext = strrchr(name, '.');
+	return ext && (!strcmp(ext, ".png") || !strcmp(ext, ".webp") || !strcmp(ext, ".jpg"));
+}
+
+static size_t EstimateBytes(struct PrewarmAsset* asset) {
+	// The decoded size of a PNG can be read from its IHDR chunk, anything else is kept
+	// as it is on disk. Returns 0 when the file can't be read.
+	ALLEGRO_FILE* file = al_fopen(asset->path, "rb");
+	if (!file) {
+		return 0;
+	}
+	size_t bytes = al_fsize(file);
+	unsigned char header[24];
+	if (IsBitmap(asset->name) && (al_fread(file, header, sizeof(header)) == sizeof(header)) && !memcmp(header + 1, "PNG", 3)) {
+		size_t width = ((uint32_t)header[16] << 24) | ((uint32_t)header[17] << 16) | ((uint32_t)header[18] << 8) | header[19];
+		size_t height = ((uint32_t)header[20] << 24) | ((uint32_t)header[21] << 16) | ((uint32_t)header[22] << 8) | header[23];
+		bytes = width * height * 4;
+	}
+	al_fclose(file);
+	return bytes;
+}
+
+static void DecodeAsset(struct PrewarmAsset* asset) {
+	if (IsBitmap(asset->name)) {
+		asset->bitmap = al_load_bitmap(asset->path);
+		if (asset->bitmap) {
+			asset->bytes = (size_t)al_get_bitmap_width(asset->bitmap) * al_get_bitmap_height(asset->bitmap) * 4;
+		}
+		return;
+	}
+
+	ALLEGRO_FILE* file = al_fopen(asset->path, "rb");
+	if (!file) {
+		return;
+	}
+	int64_t size = al_fsize(file);
+	asset->buffer = malloc(size);
+	if (al_fread(file, asset->buffer, size) == (size_t)size) {
+		asset->size = size;
+		asset->bytes = size;
+	} else {
+		free(asset->buffer);
+		asset->buffer = NULL;
+	}
+	al_fclose(file);
+}
+
+static void* PrewarmThread(ALLEGRO_THREAD* thread, void* arg) {
+	struct Game* game = arg;
+	struct Prewarm* prewarm = &game->data->prewarm;
+	NameTraceThread(game, "prewarm");
+	al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP); // new bitmap flags are per thread
+
+	al_lock_mutex(prewarm->mutex);
+	while (!al_get_thread_should_stop(thread)) {
+		struct PrewarmAsset* asset = NULL;
+		for (int i = 0; i < prewarm->count; i++) {
+			if (prewarm->assets[i].state == PREWARM_QUEUED && (!asset || prewarm->assets[i].order < asset->order)) {
+				asset = &prewarm->assets[i];
+			}
+		}
+		if (!asset) {
+			al_wait_cond(prewarm->cond, prewarm->mutex);
+			continue;
+		}
+
+		if (!asset->bytes) {
+			prewarm->busy = asset;
+			al_unlock_mutex(prewarm->mutex);
+			size_t bytes = EstimateBytes(asset);
+			al_lock_mutex(prewarm->mutex);
+			prewarm->busy = NULL;
+			if (asset->state == PREWARM_QUEUED) {
+				asset->bytes = bytes;
+				if (!bytes || bytes > prewarm->limit) {
+					asset->state = PREWARM_FAILED;
+				}
+			}
+			continue;
+		}
+		if (prewarm->used + asset->bytes > prewarm->limit) {
+			// Assets go strictly in order, so wait for the gamestates to claim
+			// what's already decoded instead of skipping ahead.
+			al_wait_cond(prewarm->cond, prewarm->mutex);
+			continue;
+		}
+
+		size_t estimate = asset->bytes;
+		asset->state = PREWARM_LOADING;
+		prewarm->used += estimate;
+		prewarm->busy = asset;
+		al_unlock_mutex(prewarm->mutex);
+
+		double start = BeginTrace(game);
+		DecodeAsset(asset);
+		EndTrace(game, asset->name, start);
+
+		al_lock_mutex(prewarm->mutex);
+		prewarm->busy = NULL;
+		if (asset->bitmap || asset->buffer) {
+			asset->state = PREWARM_READY;
+			prewarm->used += asset->bytes - estimate;
+		} else {
+			asset->state = PREWARM_FAILED;
+			prewarm->used -= estimate;
+		}
+		al_broadcast_cond(prewarm->cond);
+
+		// Stay in the background: give the game loop room between assets.
+		al_unlock_mutex(prewarm->mutex);
+		al_rest(0.01);
+		al_lock_mutex(prewarm->mutex);
+	}
+	al_unlock_mutex(prewarm->mutex);
+	return NULL;
+}
+
+static struct PrewarmAsset* GetFreeSlot(struct Prewarm* prewarm) {
+	// Must be called with the mutex locked. Whatever got claimed or failed is done
+	// with, so its slot can take the next request. Returns NULL when all are in use.
+	for (int i = 0; i < prewarm->count; i++) {
+		struct PrewarmAsset* asset = &prewarm->assets[i];
+		if ((asset->state == PREWARM_FAILED || asset->state == PREWARM_CLAIMED) && asset != prewarm->busy) {
+			free(asset->buffer);
+			free(asset->name);
+			free(asset->path);
+			return asset;
+		}
+	}
+	if (prewarm->count < PREWARM_MAX_ASSETS) {
+		return &prewarm->assets[prewarm->count++];
+	}
+	return NULL;
+}
+
+void PrewarmGamestate(struct Game* game, const char* name) {
+	struct Prewarm* prewarm = &game->data->prewarm;
+	ALLEGRO_CONFIG* config = al_load_config_file(GetDataFilePath(game, "prewarm.ini"));
+	if (!config || !prewarm->limit) {
+		if (config) {
+			al_destroy_config(config);
+		}
+		return;
+	}
+
+	if (!prewarm->thread) {
+		prewarm->mutex = al_create_mutex();
+		prewarm->cond = al_create_cond();
+		prewarm->thread = al_create_thread(PrewarmThread, game);
+		al_start_thread(prewarm->thread);
+	}
+
+	al_lock_mutex(prewarm->mutex);
+	for (int i = 0;; i++) {
+		char key[8];
+		snprintf(key, sizeof(key), "%d", i);
+		const char* filename = al_get_config_value(config, name, key);
+		if (!filename) {
+			break;
+		}
+		bool known = false;
+		for (int j = 0; j < prewarm->count; j++) {
+			struct PrewarmAsset* asset = &prewarm->assets[j];
+			if (!strcmp(asset->name, filename) && asset->state != PREWARM_FAILED && asset->state != PREWARM_CLAIMED) {
+				known = true;
+			}
+		}
+		if (known) {
+			continue;
+		}
+		struct PrewarmAsset* asset = GetFreeSlot(prewarm);
+		if (!asset) {
+			break;
+		}
+		*asset = (struct PrewarmAsset){0};
+		asset->name = strdup(filename);
+		asset->path = strdup(GetDataFilePath(game, TieredAssetName(game, filename))); // not safe to call from the worker
+		asset->order = prewarm->requests++;
+		asset->state = PREWARM_QUEUED;
+	}
+	al_broadcast_cond(prewarm->cond);
+	al_unlock_mutex(prewarm->mutex);
+	al_destroy_config(config);
+}
+
+static struct PrewarmAsset* ClaimAsset(struct Prewarm* prewarm, const char* filename) {
+	// Must be called with the mutex locked. Returns a ready asset, or NULL if the caller
+	// has to load it by itself; queued assets are taken off the worker's list then.
+	if (!prewarm->thread) {
+		return NULL;
+	}
+	for (int i = 0; i < prewarm->count; i++) {
+		struct PrewarmAsset* asset = &prewarm->assets[i];
+		if (strcmp(asset->name, filename)) {
+			continue;
+		}
+		while (asset->state == PREWARM_LOADING) {
+			al_wait_cond(prewarm->cond, prewarm->mutex);
+		}
+		if (asset->state == PREWARM_QUEUED) {
+			asset->state = PREWARM_FAILED;
+			al_broadcast_cond(prewarm->cond);
+		}
+		if (asset->state == PREWARM_READY) {
+			return asset;
+		}
+	}
+	return NULL;
+}
+
+ALLEGRO_BITMAP* LoadPrewarmedBitmap(struct Game* game, const char* filename) {
+	struct Prewarm* prewarm = &game->data->prewarm;
+	ALLEGRO_BITMAP* bitmap = NULL;
+	double start = BeginTrace(game);
+	TrackDataFilePath(game, filename); // requested just once, prewarmed or not
+	if (prewarm->thread) {
+		al_lock_mutex(prewarm->mutex);
+		struct PrewarmAsset* asset = ClaimAsset(prewarm, filename);
+		if (asset && asset->bitmap) {
+			bitmap = asset->bitmap;
+			asset->bitmap = NULL;
+			asset->state = PREWARM_CLAIMED;
+			prewarm->used -= asset->bytes;
+			al_broadcast_cond(prewarm->cond);
+		}
+		al_unlock_mutex(prewarm->mutex);
+	}
+	if (bitmap) {
+		// uses the caller's bitmap flags, so it ends up wherever al_load_bitmap would put it
+		ALLEGRO_BITMAP* clone = al_clone_bitmap(bitmap);
+		al_destroy_bitmap(bitmap);
+		bitmap = clone;
+		NameTrackedResource(bitmap, GetDataFilePath(game, TieredAssetName(game, filename)));
+	} else {
+		bitmap = al_load_bitmap(GetDataFilePath(game, TieredAssetName(game, filename)));
+	}
+	EndTrace(game, filename, start);
+	return bitmap;
+}
+
+// Audio streams keep reading from their file for as long as they exist, so the
+// prewarmed buffer goes to the stream along with a memfile over it, and gets freed
+// once the stream closes the file.
+
+struct HandedFile {
+	ALLEGRO_FILE* memfile;
+	void* buffer;
+};
+
+static ALLEGRO_FILE* GetMemfile(ALLEGRO_FILE* f) {
+	return ((struct HandedFile*)al_get_file_userdata(f))->memfile;
+}
+
+static bool HandedFileClose(ALLEGRO_FILE* f) {
+	struct HandedFile* file = al_get_file_userdata(f);
+	bool ret = al_fclose(file->memfile);
+	free(file->buffer);
+	free(file);
+	return ret;
+}
+
+static size_t HandedFileRead(ALLEGRO_FILE* f, void* ptr, size_t size) {
+	return al_fread(GetMemfile(f), ptr, size);
+}
+
+static size_t HandedFileWrite(ALLEGRO_FILE* f, const void* ptr, size_t size) {
+	return 0;
+}
+
+static bool HandedFileFlush(ALLEGRO_FILE* f) {
+	return true;
+}
+
+static int64_t HandedFileTell(ALLEGRO_FILE* f) {
+	return al_ftell(GetMemfile(f));
+}
+
+static bool HandedFileSeek(ALLEGRO_FILE* f, int64_t offset, int whence) {
+	return al_fseek(GetMemfile(f), offset, whence);
+}
+
+static bool HandedFileEOF(ALLEGRO_FILE* f) {
+	return al_feof(GetMemfile(f));
+}
+
+static int HandedFileError(ALLEGRO_FILE* f) {
+	return al_ferror(GetMemfile(f));
+}
+
+static const char* HandedFileErrmsg(ALLEGRO_FILE* f) {
+	return al_ferrmsg(GetMemfile(f));
+}
+
+static void HandedFileClearerr(ALLEGRO_FILE* f) {
+	al_fclearerr(GetMemfile(f));
+}
+
+static int HandedFileUngetc(ALLEGRO_FILE* f, int c) {
+	return al_fungetc(GetMemfile(f), c);
+}
+
+static off_t HandedFileSize(ALLEGRO_FILE* f) {
+	return al_fsize(GetMemfile(f));
+}
+
+static const ALLEGRO_FILE_INTERFACE handed_file_interface = {
+	NULL,
+	HandedFileClose,
+	HandedFileRead,
+	HandedFileWrite,
+	HandedFileFlush,
+	HandedFileTell,
+	HandedFileSeek,
+	HandedFileEOF,
+	HandedFileError,
+	HandedFileErrmsg,
+	HandedFileClearerr,
+	HandedFileUngetc,
+	HandedFileSize,
+};
+
+static ALLEGRO_FILE* HandOverBuffer(struct Prewarm* prewarm, struct PrewarmAsset* asset) {
+	// Must be called with the mutex locked. The buffer no longer counts against the
+	// cap and the slot gets free for another asset.
+	struct HandedFile* file = malloc(sizeof(struct HandedFile));
+	file->buffer = asset->buffer;
+	file->memfile = al_open_memfile(asset->buffer, asset->size, "r");
+	asset->buffer = NULL;
+	asset->state = PREWARM_CLAIMED;
+	prewarm->used -= asset->bytes;
+	al_broadcast_cond(prewarm->cond);
+	return al_create_file_handle(&handed_file_interface, file);
+}
+
+ALLEGRO_AUDIO_STREAM* LoadPrewarmedAudioStream(struct Game* game, const char* filename, size_t buffer_count, unsigned int samples) {
+	struct Prewarm* prewarm = &game->data->prewarm;
+	ALLEGRO_AUDIO_STREAM* stream = NULL;
+	double start = BeginTrace(game);
+	TrackDataFilePath(game, filename); // requested just once, prewarmed or not
+	if (prewarm->thread) {
+		ALLEGRO_FILE* file = NULL;
+		al_lock_mutex(prewarm->mutex);
+		struct PrewarmAsset* asset = ClaimAsset(prewarm, filename);
+		if (asset && asset->buffer) {
+			file = HandOverBuffer(prewarm, asset);
+		}
+		al_unlock_mutex(prewarm->mutex);
+		if (file) {
+			stream = al_load_audio_stream_f(file, strrchr(filename, '.'), buffer_count, samples);
+			if (!stream) {
+				al_fclose(file);
+			}
+		}
+	}
+	if (!stream) {
+		stream = al_load_audio_stream(GetDataFilePath(game, TieredAssetName(game, filename)), buffer_count, samples);
+	}
+	EndTrace(game, filename, start);
+	return stream;
+}
+
+void DestroyPrewarm(struct Game* game) {
+	struct Prewarm* prewarm = &game->data->prewarm;
+	if (!prewarm->thread) {
+		return;
+	}
+	al_lock_mutex(prewarm->mutex);
+	al_set_thread_should_stop(prewarm->thread);
+	al_broadcast_cond(prewarm->cond);
+	al_unlock_mutex(prewarm->mutex);
+	al_join_thread(prewarm->thread, NULL);
+	al_destroy_thread(prewarm->thread);
+	al_destroy_cond(prewarm->cond);
+	al_destroy_mutex(prewarm->mutex);
+
+	for (int i = 0; i < prewarm->count; i++) {
+		if (prewarm->assets[i].bitmap) {
+			al_destroy_bitmap(prewarm->assets[i].bitmap);
+		}
+		free(prewarm->assets[i].buffer);
+		free(prewarm->assets[i].name);
+		free(prewarm->assets[i].path);
+	}
+	prewarm->count = 0;
+	prewarm->busy = NULL;
+	prewarm->thread = NULL;
+}
@@ -0,0 +1,167 @@
+/*! \file progress.c
+ *  \brief Loading progress weighed by the size of the files being loaded.
+ */
+/*
+ * Copyright (c) Sebastian Krzyszkowiak <dos@dosowisko.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "common.h"
+#include <libsuperderpy.h>
+#include <math.h>
+#include <string.h>
+
+#undef GetDataFilePath // looking files up must not count them as loaded
+
+// A gamestate announces the files it's going to load with ExpectLoadingAssets.
+// They're read from its section of data/prewarm.ini, which already lists most of
+// them, followed by the same section of data/loading.ini with the rest. Each file
+// counts towards the progress with its size on disk once its path gets requested
+// through GetDataFilePath. Files loaded by the engine itself (like spritesheets)
+// have to be counted with CountLoadedAssets by the gamestate. Anything not listed
+// doesn't count, so the progress never goes past what's expected.
+//
+// Gamestates are loaded on another thread, so all of it is guarded by a mutex.
+
+static int64_t FileSize(const char* path) {
+	ALLEGRO_FS_ENTRY* entry = al_create_fs_entry(path);
+	int64_t size = al_fs_entry_exists(entry) ? al_get_fs_entry_size(entry) : 0;
+	al_destroy_fs_entry(entry);
+	return size;
+}
+
+static void AddLoadingAsset(struct Game* game, const char* name, int64_t bytes) {
+	// Directories may list files from prewarm.ini again; they only count once.
+	struct LoadingProgress* loading = &game->data->loading;
+	for (int i = 0; i < loading->count; i++) {
+		if (!strcmp(loading->assets[i].name, name)) {
+			return;
+		}
+	}
+	loading->assets = realloc(loading->assets, sizeof(struct LoadingAsset) * (loading->count + 1));
+	loading->assets[loading->count++] = (struct LoadingAsset){.name = strdup(name), .bytes = bytes};
+	loading->total += bytes;
+}
+
+static void AddLoadingDirectory(struct Game* game, const char* name, ALLEGRO_FS_ENTRY* dir) {
+	// Directories are listed file by file, so they can be counted the same way.
+	if (!al_open_directory(dir)) {
+		return;
+	}
+	ALLEGRO_FS_ENTRY* entry;
+	while ((entry = al_read_directory(dir))) {
+		if (!(al_get_fs_entry_mode(entry) & ALLEGRO_FILEMODE_ISDIR)) {
+			ALLEGRO_PATH* path = al_create_path(al_get_fs_entry_name(entry));
+			char filename[1024];
+			snprintf(filename, sizeof(filename), "%s/%s", name, al_get_path_filename(path));
+			AddLoadingAsset(game, filename, al_get_fs_entry_size(entry));
+			al_destroy_path(path);
+		}
+		al_destroy_fs_entry(entry);
+	}
+	al_close_directory(dir);
+}
+
+static void ResetLoadingAssets(struct LoadingProgress* loading) {
+	for (int i = 0; i < loading->count; i++) {
+		free(loading->assets[i].name);
+	}
+	free(loading->assets);
+	loading->assets = NULL;
+	loading->count = 0;
+	loading->bytes = 0;
+	loading->total = 0;
+}
+
+static void AddLoadingAssets(struct Game* game, const char* name, const char* manifest) {
+	ALLEGRO_CONFIG* config = al_load_config_file(GetDataFilePath(game, manifest));
+	if (!config) {
+		return;
+	}
+	for (int i = 0;; i++) {
+		char key[8];
+		snprintf(key, sizeof(key), "%d", i);
+		const char* filename = al_get_config_value(config, name, key);
+		if (!filename) {
+			break;
+		}
+		const char* path = GetDataFilePath(game, TieredAssetName(game, filename));
+		ALLEGRO_FS_ENTRY* entry = al_create_fs_entry(path);
+		if (al_fs_entry_exists(entry) && (al_get_fs_entry_mode(entry) & ALLEGRO_FILEMODE_ISDIR)) {
+			AddLoadingDirectory(game, filename, entry);
+		} else {
+			AddLoadingAsset(game, filename, FileSize(path));
+		}
+		al_destroy_fs_entry(entry);
+	}
+	al_destroy_config(config);
+}
+
+void ExpectLoadingAssets(struct Game* game, const char* name) {
+	struct LoadingProgress* loading = &game->data->loading;
+	al_lock_mutex(loading->mutex);
+	if (loading->bytes >= loading->total) {
+		ResetLoadingAssets(loading); // left over from the previous loading screen
+	}
+	AddLoadingAssets(game, name, "prewarm.ini");
+	AddLoadingAssets(game, name, "loading.ini");
+	al_unlock_mutex(loading->mutex);
+}
+
+void CountLoadedAssets(struct Game* game, const char* name) {
+	// Counts the expected file, or every expected file in the directory. Called by
+	// TrackDataFilePath for each requested file.
+	struct LoadingProgress* loading = game->data ? &game->data->loading : NULL;
+	if (!loading || !loading->mutex) {
+		return;
+	}
+	size_t length = strlen(name);
+	al_lock_mutex(loading->mutex);
+	for (int i = 0; i < loading->count; i++) {
+		struct LoadingAsset* asset = &loading->assets[i];
+		if (!asset->loaded && !strncmp(asset->name, name, length) && (asset->name[length] == '\0' || asset->name[length] == '/')) {
+			asset->loaded = true;
+			loading->bytes += asset->bytes;
+		}
+	}
+	al_unlock_mutex(loading->mutex);
+}
+
+double GetLoadingProgress(struct Game* game) {
+	// Falls back to the engine's count of loading steps when nothing was announced.
+	struct LoadingProgress* loading = &game->data->loading;
+	double progress = game->loading.progress;
+	al_lock_mutex(loading->mutex);
+	if (loading->total > 0) {
+		progress = fmin(loading->bytes / (double)loading->total, 1.0);
+	}
+	al_unlock_mutex(loading->mutex);
+	return progress;
+}
+
+void FinishLoadingProgress(struct Game* game) {
+	struct LoadingProgress* loading = &game->data->loading;
+	al_lock_mutex(loading->mutex);
+	ResetLoadingAssets(loading);
+	al_unlock_mutex(loading->mutex);
+}
+
+void DestroyLoadingProgress(struct Game* game) {
+	struct LoadingProgress* loading = &game->data->loading;
+	ResetLoadingAssets(loading);
+	al_destroy_mutex(loading->mutex);
+	loading->mutex = NULL;
+}
@@ -0,0 +1,171 @@
+/*! \file replay.c
+ *  \brief Input recording and deterministic replay.
+ */
+/*
+ * Copyright (c) Sebastian Krzyszkowiak <dos@dosowisko.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "common.h"
+#include <libsuperderpy.h>
+#include <string.h>
+
+// A replay is a header with the RNG seed followed by fixed-size records in native
+// byte order: the inputs that arrived before each tick, then the tick itself with
+// the beat it was simulated at and a hash of the state it left behind. Feeding
+// the inputs back at the same tick indices reproduces the session, and comparing
+// the hashes tells where it stopped doing so.
+//
+// Only the first session of a gamestate that calls BeginReplay is recorded or replayed.
+
+#define REPLAY_MAGIC "SDRP"
+#define REPLAY_VERSION 1
+
+struct ReplayHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t seed;
+	uint32_t reserved;
+};
+
+void StartReplay(struct Game* game, const char* filename, bool record) {
+	struct Replay* replay = &game->data->replay;
+	replay->filename = filename;
+	replay->file = fopen(filename, record ? "wb" : "rb");
+	if (!replay->file) {
+		PrintConsole(game, "replay: could not open %s", filename);
+		return;
+	}
+	replay->recording = record;
+	replay->replaying = !record;
+}
+
+uint32_t BeginReplay(struct Game* game, uint32_t seed) {
+	// Returns the seed the session should use.
+	struct Replay* replay = &game->data->replay;
+	struct ReplayHeader header = {REPLAY_MAGIC, REPLAY_VERSION, seed, 0};
+	replay->tick = 0;
+	replay->pending = false;
+	replay->diverged = false;
+
+	if (replay->recording) {
+		fwrite(&header, sizeof(header), 1, replay->file);
+		PrintConsole(game, "replay: recording to %s with seed %u", replay->filename, seed);
+	} else if (replay->replaying) {
+		if ((fread(&header, sizeof(header), 1, replay->file) != 1) || memcmp(header.magic, REPLAY_MAGIC, 4) || (header.version != REPLAY_VERSION)) {
+			PrintConsole(game, "replay: %s is not a replay", replay->filename);
+			FinishReplay(game);
+			return seed;
+		}
+		PrintConsole(game, "replay: playing %s with seed %u", replay->filename, header.seed);
+	}
+	return header.seed;
+}
+
+void RecordReplayInput(struct Game* game, int kind, int code, float value, double ahead) {
+	struct Replay* replay = &game->data->replay;
+	if (!replay->recording) {
+		return;
+	}
+	struct ReplayRecord record = {replay->tick, kind, code, value, 0, ahead};
+	fwrite(&record, sizeof(record), 1, replay->file);
+}
+
+static bool PeekRecord(struct Replay* replay) {
+	if (!replay->pending) {
+		replay->pending = (fread(&replay->next, sizeof(struct ReplayRecord), 1, replay->file) == 1);
+	}
+	return replay->pending;
+}
+
+bool ReplayInput(struct Game* game, struct ReplayRecord* record) {
+	// Hands out the inputs recorded before the current tick, one at a time.
+	struct Replay* replay = &game->data->replay;
+	if (!replay->replaying || !PeekRecord(replay) || (replay->next.kind == REPLAY_TICK)) {
+		return false;
+	}
+	*record = replay->next;
+	replay->pending = false;
+	return true;
+}
+
+bool ReplayTick(struct Game* game, double* beat) {
+	// Returns false once a replay runs out. Outside of replays the beat is left alone.
+	struct Replay* replay = &game->data->replay;
+	if (!replay->replaying) {
+		return true;
+	}
+	struct ReplayRecord record;
+	while (ReplayInput(game, &record)) {
+		// inputs not consumed by the gamestate, skip them
+	}
+	if (!PeekRecord(replay)) {
+		return false;
+	}
+	*beat = replay->next.time;
+	return true;
+}
+
+void FinishReplayTick(struct Game* game, double beat, uint32_t hash) {
+	struct Replay* replay = &game->data->replay;
+	if (replay->recording) {
+		struct ReplayRecord record = {replay->tick, REPLAY_TICK, 0, 0, hash, beat};
+		fwrite(&record, sizeof(record), 1, replay->file);
+	} else if (replay->replaying && replay->pending) {
+		if (((replay->next.tick != replay->tick) || (replay->next.hash != hash)) && !replay->diverged) {
+			PrintConsole(game, "replay: diverged at tick %u", replay->tick);
+			replay->diverged = true;
+		}
+		replay->pending = false;
+	}
+	replay->tick++;
+}
+
+void FinishReplay(struct Game* game) {
+	struct Replay* replay = &game->data->replay;
+	if (!replay->file) {
+		return;
+	}
+	if (replay->recording) {
+		PrintConsole(game, "replay: recorded %u ticks with score %d to %s", replay->tick, game->data->score, replay->filename);
+	} else if (replay->replaying) {
+		PrintConsole(game, "replay: replayed %u ticks with score %d, %s", replay->tick, game->data->score, replay->diverged ? "diverged" : "in sync");
+	}
+	fclose(replay->file);
+	replay->file = NULL;
+	replay->recording = false;
+	replay->replaying = false;
+}
+
+uint32_t HashState(uint32_t hash, const void* ptr, size_t size) {
+	// FNV-1a, start with 2166136261
+	const unsigned char* bytes = ptr;
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ bytes[i]) * 16777619;
+	}
+	return hash;
+}
+
+int Random(uint32_t* state) {
+	// xorshift32, for simulations that have to come out the same from the same seed
+	if (!*state) {
+		*state = 2463534242;
+	}
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state & RANDOM_MAX;
+}
@@ -0,0 +1,237 @@
+/*! \file resources.c
+ *  \brief Resource lifecycle tracker.
+ */
+/*
+ * Copyright (c) Sebastian Krzyszkowiak <dos@dosowisko.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "common.h"
+#include <libsuperderpy.h>
+#include <string.h>
+
+// With TRACK_RESOURCES defined (debug builds), common.h routes the Allegro calls
+// that create and destroy bitmaps, samples, streams and fonts through here. Every
+// live resource is remembered along with the gamestate that was being loaded when
+// it got created, so whatever is left when that gamestate unloads is a leak.
+// The wrappers call the real functions by putting their names in parentheses.
+//
+// Loading from files always goes through here, so that it shows up in traces.
+
+static const char* resource_types[RESOURCE_TYPES] = {"bitmap", "sample", "sample instance", "stream", "font"};
+
+struct TrackedResource {
+	void* ptr;
+	int type;
+	const char* scope;
+	char* file;
+};
+
+static struct {
+	ALLEGRO_MUTEX* mutex;
+	struct TrackedResource* resources;
+	int count, size;
+	int live[RESOURCE_TYPES], peak[RESOURCE_TYPES];
+	int duplicates;
+} tracker;
+
+static _Thread_local const char* scope = NULL;
+
+void SetResourceScope(const char* gamestate) {
+	scope = gamestate;
+}
+
+static void CheckDuplicate(int type, const char* file) {
+	// Must be called with the mutex locked, before the resource gets its file.
+	if (!file) {
+		return;
+	}
+	for (int i = 0; i < tracker.count; i++) {
+		if ((tracker.resources[i].type == type) && tracker.resources[i].file && !strcmp(tracker.resources[i].file, file)) {
+			fprintf(stderr, "resources: %s %s loaded again by %s (already loaded by %s)\n", resource_types[type], file,
+				scope ? scope : "main", tracker.resources[i].scope ? tracker.resources[i].scope : "main");
+			tracker.duplicates++;
+			break;
+		}
+	}
+}
+
+static void* TrackResource(int type, void* ptr, const char* file) {
+	// Loading goes through here in release builds too, but only gets tracked in debug ones.
+#ifdef TRACK_RESOURCES
+	if (!ptr) {
+		return NULL;
+	}
+	if (!tracker.mutex) {
+		tracker.mutex = al_create_mutex(); // first use is on the main thread, during startup
+	}
+	al_lock_mutex(tracker.mutex);
+	CheckDuplicate(type, file);
+	if (tracker.count == tracker.size) {
+		tracker.size = tracker.size ? tracker.size * 2 : 256;
+		tracker.resources = realloc(tracker.resources, sizeof(struct TrackedResource) * tracker.size);
+	}
+	tracker.resources[tracker.count++] = (struct TrackedResource){ptr, type, scope, file ? strdup(file) : NULL};
+	if (++tracker.live[type] > tracker.peak[type]) {
+		tracker.peak[type] = tracker.live[type];
+	}
+	al_unlock_mutex(tracker.mutex);
+#endif
+	return ptr;
+}
+
+static void UntrackResource(void* ptr) {
+	if (!ptr || !tracker.mutex) {
+		return;
+	}
+	al_lock_mutex(tracker.mutex);
+	for (int i = 0; i < tracker.count; i++) {
+		if (tracker.resources[i].ptr == ptr) {
+			tracker.live[tracker.resources[i].type]--;
+			free(tracker.resources[i].file);
+			tracker.resources[i] = tracker.resources[--tracker.count];
+			break;
+		}
+	}
+	al_unlock_mutex(tracker.mutex);
+}
+
+void NameTrackedResource(void* ptr, const char* file) {
+	// For resources made from something loaded elsewhere, like prewarmed bitmaps
+	// cloned into video memory, so they're reported with the file they came from.
+	if (!ptr || !tracker.mutex) {
+		return;
+	}
+	al_lock_mutex(tracker.mutex);
+	for (int i = 0; i < tracker.count; i++) {
+		struct TrackedResource* resource = &tracker.resources[i];
+		if (resource->ptr == ptr) {
+			free(resource->file);
+			resource->file = NULL;
+			CheckDuplicate(resource->type, file);
+			resource->file = strdup(file);
+			break;
+		}
+	}
+	al_unlock_mutex(tracker.mutex);
+}
+
+void ReportResources(struct Game* game, const char* gamestate) {
+	// Lists resources created while loading the given gamestate that are still alive,
+	// or everything that's left along with peak counts when gamestate is NULL.
+	if (!tracker.mutex) {
+		return;
+	}
+	al_lock_mutex(tracker.mutex);
+	int leaks = 0;
+	for (int i = 0; i < tracker.count; i++) {
+		struct TrackedResource* resource = &tracker.resources[i];
+		if (gamestate && (!resource->scope || strcmp(resource->scope, gamestate))) {
+			continue;
+		}
+		PrintConsole(game, "resources: leaked %s %s (%s)", resource_types[resource->type], resource->file ? resource->file : "(created)",
+			resource->scope ? resource->scope : "main");
+		leaks++;
+	}
+	if (gamestate) {
+		if (leaks) {
+			PrintConsole(game, "resources: %s leaked %d resources", gamestate, leaks);
+		}
+	} else {
+		for (int i = 0; i < RESOURCE_TYPES; i++) {
+			PrintConsole(game, "resources: %s peak %d, %d alive at exit", resource_types[i], tracker.peak[i], tracker.live[i]);
+		}
+		PrintConsole(game, "resources: %d leaks, %d duplicate loads", leaks, tracker.duplicates);
+	}
+	al_unlock_mutex(tracker.mutex);
+}
+
+ALLEGRO_BITMAP* TrackLoadBitmap(const char* filename) {
+	double start = BeginLoadTrace();
+	ALLEGRO_BITMAP* bitmap = (al_load_bitmap)(filename);
+	EndLoadTrace(filename, start);
+	return TrackResource(RESOURCE_BITMAP, bitmap, filename);
+}
+
+ALLEGRO_BITMAP* TrackCreateBitmap(int width, int height) {
+	return TrackResource(RESOURCE_BITMAP, (al_create_bitmap)(width, height), NULL);
+}
+
+ALLEGRO_BITMAP* TrackCreateNotPreservedBitmap(int width, int height) {
+	return TrackResource(RESOURCE_BITMAP, (CreateNotPreservedBitmap)(width, height), NULL);
+}
+
+ALLEGRO_BITMAP* TrackCloneBitmap(ALLEGRO_BITMAP* bitmap) {
+	return TrackResource(RESOURCE_BITMAP, (al_clone_bitmap)(bitmap), NULL);
+}
+
+void TrackDestroyBitmap(ALLEGRO_BITMAP* bitmap) {
+	UntrackResource(bitmap);
+	(al_destroy_bitmap)(bitmap);
+}
+
+ALLEGRO_SAMPLE* TrackLoadSample(const char* filename) {
+	double start = BeginLoadTrace();
+	ALLEGRO_SAMPLE* sample = (al_load_sample)(filename);
+	EndLoadTrace(filename, start);
+	return TrackResource(RESOURCE_SAMPLE, sample, filename);
+}
+
+void TrackDestroySample(ALLEGRO_SAMPLE* sample) {
+	UntrackResource(sample);
+	(al_destroy_sample)(sample);
+}
+
+ALLEGRO_SAMPLE_INSTANCE* TrackCreateSampleInstance(ALLEGRO_SAMPLE* sample) {
+	return TrackResource(RESOURCE_SAMPLE_INSTANCE, (al_create_sample_instance)(sample), NULL);
+}
+
+void TrackDestroySampleInstance(ALLEGRO_SAMPLE_INSTANCE* instance) {
+	UntrackResource(instance);
+	(al_destroy_sample_instance)(instance);
+}
+
+ALLEGRO_AUDIO_STREAM* TrackLoadAudioStream(const char* filename, size_t buffer_count, unsigned int samples) {
+	double start = BeginLoadTrace();
+	ALLEGRO_AUDIO_STREAM* stream = (al_load_audio_stream)(filename, buffer_count, samples);
+	EndLoadTrace(filename, start);
+	return TrackResource(RESOURCE_STREAM, stream, filename);
+}
+
+ALLEGRO_AUDIO_STREAM* TrackLoadAudioStreamF(ALLEGRO_FILE* file, const char* ident, size_t buffer_count, unsigned int samples) {
+	return TrackResource(RESOURCE_STREAM, (al_load_audio_stream_f)(file, ident, buffer_count, samples), NULL);
+}
+
+void TrackDestroyAudioStream(ALLEGRO_AUDIO_STREAM* stream) {
+	UntrackResource(stream);
+	(al_destroy_audio_stream)(stream);
+}
+
+ALLEGRO_FONT* TrackLoadTtfFont(const char* filename, int size, int flags) {
+	double start = BeginLoadTrace();
+	ALLEGRO_FONT* font = (al_load_ttf_font)(filename, size, flags);
+	EndLoadTrace(filename, start);
+	return TrackResource(RESOURCE_FONT, font, filename);
+}
+
+ALLEGRO_FONT* TrackCreateBuiltinFont(void) {
+	return TrackResource(RESOURCE_FONT, (al_create_builtin_font)(), NULL);
+}
+
+void TrackDestroyFont(ALLEGRO_FONT* font) {
+	UntrackResource(font);
+	(al_destroy_font)(font);
+}
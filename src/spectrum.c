@@ -0,0 +1,202 @@
+/*! \file spectrum.c
+ *  \brief Spectrum analysis of the music mixer's output.
+ */
+/*
+ * Copyright (c) Sebastian Krzyszkowiak <dos@dosowisko.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "common.h"
+#include <libsuperderpy.h>
+#include <math.h>
+#include <string.h>
+
+// Whatever the music mixer outputs is mixed down to mono and transformed every
+// SPECTRUM_HOP samples, on the audio thread, from the mixer's postprocess
+// callback. Each transform yields the energy of SPECTRUM_BANDS log-spaced bands
+// relative to their recent peaks, and counts onsets found in the spectral flux.
+// The result gets published through a sequence lock, so the audio thread never
+// waits for the drawing one; ReadSpectrum retries instead if it raced a write.
+
+static const float BAND_EDGES[SPECTRUM_BANDS + 1] = {40, 120, 300, 800, 2000, 5000, 12000}; // Hz
+
+#define PEAK_DECAY 0.995 // per transform, so a quiet passage gets its lights back in a few seconds
+#define ONSET_RATIO 1.5 // flux over its running mean that counts as an onset
+#define ONSET_HOLDOFF 0.1 // seconds
+
+static void Transform(float* restrict re, float* restrict im, const float* restrict twiddle_re, const float* restrict twiddle_im) {
+	// Iterative radix-2 FFT over input already in bit-reversed order. Real and
+	// imaginary parts live in separate arrays and the inner loop runs over
+	// contiguous butterflies, which lets the compiler vectorize it.
+	for (int half = 1; half < SPECTRUM_SIZE; half *= 2) {
+		const float* wr = twiddle_re + half - 1;
+		const float* wi = twiddle_im + half - 1;
+		for (int start = 0; start < SPECTRUM_SIZE; start += half * 2) {
+			float *ar = re + start, *ai = im + start, *br = re + start + half, *bi = im + start + half;
+			for (int k = 0; k < half; k++) {
+				float tr = br[k] * wr[k] - bi[k] * wi[k];
+				float ti = br[k] * wi[k] + bi[k] * wr[k];
+				br[k] = ar[k] - tr;
+				bi[k] = ai[k] - ti;
+				ar[k] += tr;
+				ai[k] += ti;
+			}
+		}
+	}
+}
+
+static void Publish(struct Spectrum* spectrum) {
+	unsigned int sequence = spectrum->sequence;
+	__atomic_store_n(&spectrum->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	spectrum->published = spectrum->current;
+	__atomic_store_n(&spectrum->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+static void Analyse(struct Spectrum* spectrum) {
+	for (int i = 0; i < SPECTRUM_SIZE; i++) {
+		int j = spectrum->reverse[i];
+		spectrum->re[j] = spectrum->input[(spectrum->position + i) % SPECTRUM_SIZE] * spectrum->window[i];
+		spectrum->im[j] = 0;
+	}
+	Transform(spectrum->re, spectrum->im, spectrum->twiddle_re, spectrum->twiddle_im);
+
+	float flux = 0;
+	for (int k = 0; k < SPECTRUM_SIZE / 2; k++) {
+		float magnitude = sqrtf(spectrum->re[k] * spectrum->re[k] + spectrum->im[k] * spectrum->im[k]);
+		if (magnitude > spectrum->magnitudes[k]) {
+			flux += magnitude - spectrum->magnitudes[k];
+		}
+		spectrum->magnitudes[k] = magnitude;
+	}
+
+	for (int b = 0; b < SPECTRUM_BANDS; b++) {
+		float energy = 0;
+		for (int k = spectrum->edges[b]; k < spectrum->edges[b + 1]; k++) {
+			energy += spectrum->magnitudes[k] * spectrum->magnitudes[k];
+		}
+		energy /= fmax(1, spectrum->edges[b + 1] - spectrum->edges[b]);
+		spectrum->peaks[b] = fmax(energy, fmax(spectrum->peaks[b] * PEAK_DECAY, 1e-6));
+		spectrum->current.bands[b] = energy / spectrum->peaks[b];
+	}
+
+	spectrum->holdoff -= SPECTRUM_HOP;
+	if ((flux > spectrum->flux_mean * ONSET_RATIO) && (flux > 1e-3) && (spectrum->holdoff <= 0)) {
+		spectrum->current.onsets++;
+		spectrum->holdoff = ONSET_HOLDOFF * spectrum->frequency;
+	}
+	spectrum->flux_mean = spectrum->flux_mean * 0.9 + flux * 0.1;
+
+	Publish(spectrum);
+}
+
+static void AnalyseMusic(struct Game* game, void* buffer, unsigned int samples) {
+	struct Spectrum* spectrum = &game->data->spectrum;
+	if (!spectrum->enabled) {
+		return;
+	}
+	double start = al_get_time();
+	for (unsigned int i = 0; i < samples; i++) {
+		float sample = 0;
+		for (int c = 0; c < spectrum->channels; c++) {
+			if (spectrum->depth == ALLEGRO_AUDIO_DEPTH_FLOAT32) {
+				sample += ((float*)buffer)[i * spectrum->channels + c];
+			} else {
+				sample += ((int16_t*)buffer)[i * spectrum->channels + c] / 32768.0f;
+			}
+		}
+		spectrum->input[spectrum->position] = sample / spectrum->channels;
+		spectrum->position = (spectrum->position + 1) % SPECTRUM_SIZE;
+		if (++spectrum->pending == SPECTRUM_HOP) {
+			spectrum->pending = 0;
+			Analyse(spectrum);
+		}
+	}
+	double cost = al_get_time() - start;
+	if (cost > spectrum->cost_max) {
+		spectrum->cost_max = cost;
+	}
+}
+
+static void MusicPostprocess(void* buffer, unsigned int samples, void* userdata) {
+	// Runs on the audio thread after every buffer mixed by the music mixer.
+	struct Game* game = userdata;
+	double start = BeginTrace(game);
+	AnalyseMusic(game, buffer, samples);
+	EndTrace(game, "spectrum", start);
+}
+
+void StartSpectrum(struct Game* game) {
+	struct Spectrum* spectrum = &game->data->spectrum;
+	spectrum->depth = al_get_mixer_depth(game->audio.music);
+	if ((spectrum->depth != ALLEGRO_AUDIO_DEPTH_FLOAT32) && (spectrum->depth != ALLEGRO_AUDIO_DEPTH_INT16)) {
+		PrintConsole(game, "Music mixer depth %d can't be analysed", spectrum->depth);
+		return;
+	}
+	spectrum->channels = al_get_channel_count(al_get_mixer_channels(game->audio.music));
+	spectrum->frequency = al_get_mixer_frequency(game->audio.music);
+
+	for (int i = 0; i < SPECTRUM_SIZE; i++) {
+		spectrum->window[i] = 0.5 - 0.5 * cos(2 * ALLEGRO_PI * i / (SPECTRUM_SIZE - 1)); // Hann
+		int reversed = 0;
+		for (int bit = 1, rev = SPECTRUM_SIZE / 2; bit < SPECTRUM_SIZE; bit *= 2, rev /= 2) {
+			if (i & bit) {
+				reversed |= rev;
+			}
+		}
+		spectrum->reverse[i] = reversed;
+	}
+	// Twiddles of the stage combining pairs of half-size transforms are stored
+	// at [half - 1, 2 * half - 1), so that every stage reads them contiguously.
+	for (int half = 1; half < SPECTRUM_SIZE; half *= 2) {
+		for (int k = 0; k < half; k++) {
+			spectrum->twiddle_re[half - 1 + k] = cos(-ALLEGRO_PI * k / half);
+			spectrum->twiddle_im[half - 1 + k] = sin(-ALLEGRO_PI * k / half);
+		}
+	}
+	for (int i = 0; i <= SPECTRUM_BANDS; i++) {
+		int bin = BAND_EDGES[i] * SPECTRUM_SIZE / spectrum->frequency;
+		spectrum->edges[i] = fmax(1, fmin(bin, SPECTRUM_SIZE / 2));
+	}
+	spectrum->enabled = true;
+	al_set_mixer_postprocess_callback(game->audio.music, MusicPostprocess, game);
+}
+
+bool ReadSpectrum(struct Game* game, struct SpectrumFrame* frame) {
+	// Copies the latest analysis into frame. Returns false when there's none yet.
+	struct Spectrum* spectrum = &game->data->spectrum;
+	unsigned int before, after;
+	do {
+		before = __atomic_load_n(&spectrum->sequence, __ATOMIC_ACQUIRE);
+		if (!before) {
+			return false;
+		}
+		*frame = spectrum->published;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&spectrum->sequence, __ATOMIC_RELAXED);
+	} while ((before != after) || (before % 2));
+	return true;
+}
+
+void FinishSpectrum(struct Game* game) {
+	struct Spectrum* spectrum = &game->data->spectrum;
+	if (!spectrum->enabled) {
+		return;
+	}
+	al_set_mixer_postprocess_callback(game->audio.music, NULL, NULL);
+	spectrum->enabled = false;
+	PrintConsole(game, "Spectrum: %d onsets, worst buffer took %.3f ms", spectrum->current.onsets, spectrum->cost_max * 1000.0);
+}
@@ -0,0 +1,76 @@
+/*! \file static.c
+ *  \brief Registration of gamestates linked into the executable.
+ */
+/*
+ * Copyright (c) Sebastian Krzyszkowiak <dos@dosowisko.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "common.h"
+#include <libsuperderpy.h>
+
+// Built only with STATIC_GAMESTATES. Every gamestate is then compiled into the
+// executable with GAMESTATE_NAME defined, which prefixes its entry points with
+// its name (see common.h), and gets registered here so that LoadGamestate never
+// has to look for a plugin. Entry points a gamestate doesn't define are weak
+// and end up NULL, the same as a missing symbol in a plugin.
+
+#define GAMESTATE_LIST(X) X(dosowisko) X(holypangolin) X(loading) X(intro) X(tutorial) X(disco) X(outro)
+
+#define DECLARE_GAMESTATE(name)                                                                                 \
+	__attribute__((weak)) void name##_Gamestate_Draw(struct Game* game, void* data);                              \
+	__attribute__((weak)) void name##_Gamestate_Logic(struct Game* game, void* data, double delta);               \
+	__attribute__((weak)) void name##_Gamestate_Tick(struct Game* game, void* data);                              \
+	__attribute__((weak)) void* name##_Gamestate_Load(struct Game* game, void (*progress)(struct Game* game));    \
+	__attribute__((weak)) void name##_Gamestate_PostLoad(struct Game* game, void* data);                          \
+	__attribute__((weak)) void name##_Gamestate_Start(struct Game* game, void* data);                             \
+	__attribute__((weak)) void name##_Gamestate_Pause(struct Game* game, void* data);                             \
+	__attribute__((weak)) void name##_Gamestate_Resume(struct Game* game, void* data);                            \
+	__attribute__((weak)) void name##_Gamestate_Stop(struct Game* game, void* data);                              \
+	__attribute__((weak)) void name##_Gamestate_Unload(struct Game* game, void* data);                            \
+	__attribute__((weak)) void name##_Gamestate_ProcessEvent(struct Game* game, void* data, ALLEGRO_EVENT* ev);   \
+	__attribute__((weak)) void name##_Gamestate_Reload(struct Game* game, void* data);                            \
+	__attribute__((weak)) extern int name##_Gamestate_ProgressCount;
+
+#define GAMESTATE_API(name)                          \
+	{                                                \
+		.draw = name##_Gamestate_Draw,               \
+		.logic = name##_Gamestate_Logic,             \
+		.tick = name##_Gamestate_Tick,               \
+		.load = name##_Gamestate_Load,               \
+		.post_load = name##_Gamestate_PostLoad,      \
+		.start = name##_Gamestate_Start,             \
+		.pause = name##_Gamestate_Pause,             \
+		.resume = name##_Gamestate_Resume,           \
+		.stop = name##_Gamestate_Stop,               \
+		.unload = name##_Gamestate_Unload,           \
+		.process_event = name##_Gamestate_ProcessEvent, \
+		.reload = name##_Gamestate_Reload,           \
+		.progress_count = &name##_Gamestate_ProgressCount, \
+	},
+
+#define GAMESTATE_NAME_STRING(name) #name,
+
+GAMESTATE_LIST(DECLARE_GAMESTATE)
+
+static struct GamestateAPI apis[] = {GAMESTATE_LIST(GAMESTATE_API)};
+static const char* names[] = {GAMESTATE_LIST(GAMESTATE_NAME_STRING)};
+
+void RegisterStaticGamestates(struct Game* game) {
+	for (size_t i = 0; i < sizeof(apis) / sizeof(apis[0]); i++) {
+		RegisterGamestate(game, names[i], &apis[i]);
+	}
+}
@@ -0,0 +1,125 @@
+/*! \file tiers.c
+ *  \brief Resolution tiers of downscaled asset variants.
+ */
+/*
+ * Copyright (c) Sebastian Krzyszkowiak <dos@dosowisko.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "common.h"
+#include <libsuperderpy.h>
+#include <math.h>
+#include <string.h>
+
+// Bitmaps that only ever get drawn scaled down are listed in data/tiers.ini along
+// with the size they're drawn at on the 1920x1080 viewport. The asset-tiers build
+// target (cmake/AssetTiers.cmake) resamples each of them into one directory per
+// tier, and at startup the tier matching the size frames actually end up at on
+// the screen gets picked. From then on requests for those files are served from
+// the tier's directory. Anything not listed, or missing from the tier, is loaded
+// as it is.
+
+static const struct {
+	const char* name;
+	int height; // of the viewport this tier is meant for
+} TIERS[] = {
+	{"720p", 720},
+	{"1080p", 1080},
+	{"2160p", 2160},
+};
+
+#define TIER_COUNT (int)(sizeof(TIERS) / sizeof(TIERS[0]))
+
+static int PickTier(struct Game* game) {
+	const char* option = GetConfigOptionDefault(game, "SpiderDisco", "asset_tier", "auto");
+	for (int i = 0; i < TIER_COUNT; i++) {
+		if (!strcmp(option, TIERS[i].name)) {
+			return i;
+		}
+	}
+
+	// Frames end up at the display's size, unless they're drawn into the canvas (see
+	// canvas.c), which then limits their detail to the render scale. Headless runs
+	// always draw into the canvas and have no display to speak of.
+	double scale = fmin(al_get_display_width(game->display) / 1920.0, al_get_display_height(game->display) / 1080.0);
+	if (game->data->headless.enabled) {
+		scale = game->data->render_scale;
+	} else if (game->data->render_scale < 1.0) {
+		scale = fmin(scale, game->data->render_scale);
+	}
+	for (int i = 0; i < TIER_COUNT; i++) {
+		if (1080 * scale <= TIERS[i].height) {
+			return i;
+		}
+	}
+	return TIER_COUNT - 1;
+}
+
+void SelectAssetTier(struct Game* game) {
+	struct AssetTiers* tiers = &game->data->tiers;
+	DestroyAssetTiers(game);
+
+	ALLEGRO_CONFIG* config = al_load_config_file(GetDataFilePath(game, "tiers.ini"));
+	if (!config) {
+		return;
+	}
+	tiers->name = TIERS[PickTier(game)].name;
+
+	// Variants are looked up next to tiers.ini, as GetDataFilePath can't be asked about missing files.
+	char dir[1024];
+	snprintf(dir, sizeof(dir), "%s", GetDataFilePath(game, "tiers.ini"));
+	char* slash = strrchr(dir, '/');
+	*(slash ? slash + 1 : dir) = 0;
+
+	ALLEGRO_CONFIG_ENTRY* entry;
+	for (const char* name = al_get_first_config_entry(config, "sizes", &entry); name; name = al_get_next_config_entry(&entry)) {
+		char variant[255], path[1024 + 255];
+		snprintf(variant, sizeof(variant), "%s/%s", tiers->name, name);
+		snprintf(path, sizeof(path), "%s%s", dir, variant);
+		if (!al_filename_exists(path)) {
+			continue;
+		}
+		tiers->assets = realloc(tiers->assets, sizeof(struct TieredAsset) * (tiers->count + 1));
+		tiers->assets[tiers->count++] = (struct TieredAsset){strdup(name), strdup(variant)};
+	}
+	al_destroy_config(config);
+
+	PrintConsole(game, "Asset tier: %s, %d variants", tiers->name, tiers->count);
+}
+
+const char* TieredAssetName(struct Game* game, const char* filename) {
+	struct AssetTiers* tiers = game->data ? &game->data->tiers : NULL;
+	if (!tiers) {
+		return filename;
+	}
+	for (int i = 0; i < tiers->count; i++) {
+		if (!strcmp(tiers->assets[i].name, filename)) {
+			return tiers->assets[i].variant;
+		}
+	}
+	return filename;
+}
+
+void DestroyAssetTiers(struct Game* game) {
+	struct AssetTiers* tiers = &game->data->tiers;
+	for (int i = 0; i < tiers->count; i++) {
+		free(tiers->assets[i].name);
+		free(tiers->assets[i].variant);
+	}
+	free(tiers->assets);
+	tiers->assets = NULL;
+	tiers->count = 0;
+}
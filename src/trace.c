@@ -0,0 +1,175 @@
+/*! \file trace.c
+ *  \brief Chrome trace export of load, tick and draw phases.
+ */
+/*
+ * Copyright (c) Sebastian Krzyszkowiak <dos@dosowisko.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "common.h"
+#include <libsuperderpy.h>
+#include <string.h>
+
+// Events are kept in memory and written out as Chrome trace JSON when the game
+// quits, so the file can be opened in chrome://tracing or ui.perfetto.dev.
+// Spans are measured by the caller:
+//
+//   double start = BeginTrace(game);
+//   ...
+//   EndTrace(game, "Tick", start);
+//
+// Loading from files is traced by resources.c, which doesn't get to see the game,
+// so it goes through the trace that's being recorded.
+
+static _Thread_local int thread_id = 0;
+static struct Trace* recording = NULL;
+static _Thread_local char requested[64]; // see TraceDataFile
+
+static int GetTraceThread(struct Trace* trace) {
+	// Must be called with the mutex locked.
+	if (!thread_id) {
+		thread_id = ++trace->threads;
+	}
+	return thread_id;
+}
+
+static void AddEvent(struct Trace* trace, char phase, const char* name, double start, double duration) {
+	al_lock_mutex(trace->mutex);
+	if (trace->count == trace->size) {
+		if (trace->size == TRACE_MAX_EVENTS) {
+			al_unlock_mutex(trace->mutex);
+			return;
+		}
+		trace->size = trace->size ? trace->size * 2 : 4096;
+		trace->events = realloc(trace->events, sizeof(struct TraceEvent) * trace->size);
+	}
+	struct TraceEvent* event = &trace->events[trace->count++];
+	event->phase = phase;
+	snprintf(event->name, sizeof(event->name), "%s", name);
+	event->start = start - trace->origin;
+	event->duration = duration;
+	event->thread = GetTraceThread(trace);
+	al_unlock_mutex(trace->mutex);
+}
+
+void StartTrace(struct Game* game, const char* filename) {
+	struct Trace* trace = &game->data->trace;
+	trace->output = filename;
+	trace->mutex = al_create_mutex();
+	trace->origin = al_get_time();
+	trace->enabled = true;
+	recording = trace;
+	NameTraceThread(game, "main");
+}
+
+double BeginTrace(struct Game* game) {
+	if (!game->data || !game->data->trace.enabled) {
+		return 0;
+	}
+	return al_get_time();
+}
+
+void EndTrace(struct Game* game, const char* name, double start) {
+	if (!game->data || !game->data->trace.enabled) {
+		return;
+	}
+	AddEvent(&game->data->trace, 'X', name, start, al_get_time() - start);
+}
+
+void TraceInstant(struct Game* game, const char* name) {
+	if (!game->data || !game->data->trace.enabled) {
+		return;
+	}
+	AddEvent(&game->data->trace, 'i', name, al_get_time(), 0);
+}
+
+void TraceDataFile(struct Game* game, const char* filename) {
+	// Marks the request and names the load that follows it on this thread.
+	TraceInstant(game, filename);
+	snprintf(requested, sizeof(requested), "%s", filename);
+}
+
+double BeginLoadTrace(void) {
+	if (!recording) {
+		return 0;
+	}
+	return al_get_time();
+}
+
+void EndLoadTrace(const char* path, double start) {
+	if (!recording) {
+		return;
+	}
+	// The path is absolute, so show the name it was requested with if it's the same file.
+	size_t length = strlen(path), name = strlen(requested);
+	if (name && (length >= name) && !strcmp(path + length - name, requested)) {
+		AddEvent(recording, 'X', requested, start, al_get_time() - start);
+	} else {
+		const char* slash = strrchr(path, '/');
+		AddEvent(recording, 'X', slash ? slash + 1 : path, start, al_get_time() - start);
+	}
+}
+
+void NameTraceThread(struct Game* game, const char* name) {
+	// Only the first name given to a thread sticks.
+	static _Thread_local bool named = false;
+	if (!game->data || !game->data->trace.enabled || named) {
+		return;
+	}
+	AddEvent(&game->data->trace, 'M', name, game->data->trace.origin, 0);
+	named = true;
+}
+
+void FinishTrace(struct Game* game) {
+	struct Trace* trace = &game->data->trace;
+	if (!trace->enabled) {
+		return;
+	}
+	trace->enabled = false;
+	recording = NULL;
+
+	FILE* out = fopen(trace->output, "w");
+	if (out) {
+		fprintf(out, "{\"traceEvents\":[\n");
+		for (int i = 0; i < trace->count; i++) {
+			struct TraceEvent* event = &trace->events[i];
+			fprintf(out, "%s{\"pid\":1,\"tid\":%d,\"ts\":%.1f,", i ? ",\n" : "", event->thread, event->start * 1000000.0);
+			for (char* c = event->name; *c; c++) {
+				if ((*c == '"') || (*c == '\\')) {
+					*c = '_';
+				}
+			}
+			if (event->phase == 'M') {
+				fprintf(out, "\"ph\":\"M\",\"name\":\"thread_name\",\"args\":{\"name\":\"%s\"}}", event->name);
+			} else if (event->phase == 'i') {
+				fprintf(out, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\"}", event->name);
+			} else {
+				fprintf(out, "\"ph\":\"X\",\"dur\":%.1f,\"name\":\"%s\"}", event->duration * 1000000.0, event->name);
+			}
+		}
+		fprintf(out, "\n]}\n");
+		fclose(out);
+		PrintConsole(game, "Trace with %d events written to %s", trace->count, trace->output);
+	} else {
+		PrintConsole(game, "Could not write the trace to %s", trace->output);
+	}
+
+	free(trace->events);
+	trace->events = NULL;
+	trace->count = 0;
+	trace->size = 0;
+	al_destroy_mutex(trace->mutex);
+}